@@ -0,0 +1,1679 @@
+#include "FlowGridEngine.h"
+
+namespace Upp {
+
+//==============================================================================
+// Model
+//==============================================================================
+
+/** Field-wise comparison; any difference invalidates every cell. */
+bool FlowGridEngine::Options::operator==(const Options& b) const {
+    return grid == b.grid && horz == b.horz && wrap == b.wrap && virt == b.virt && vgrid == b.vgrid
+        && unified == b.unified && unified_sz == b.unified_sz && spacing == b.spacing
+        && padding == b.padding && hairline == b.hairline && align == b.align;
+}
+
+/** Model-only copy; lines, tracks and content are rebuilt by the next Layout. */
+FlowGridEngine::FlowGridEngine(const FlowGridEngine& src, int)
+:   clusters(src.clusters, 0), vcount(src.vcount), vsize(src.vsize),
+    vrows(src.vrows), vcols(src.vcols), vrow_size(src.vrow_size), vcol_size(src.vcol_size),
+    item_kind(src.item_kind, 0), item_cluster(src.item_cluster, 0), item_size(src.item_size, 0),
+    item_param(src.item_param, 0), item_rect(src.item_rect, 0), irregular(src.irregular),
+    vfrozen(src.vfrozen, 0), vtrack_rows(src.vtrack_rows, 0), vtrack_cols(src.vtrack_cols, 0),
+    vtracks_stale(src.vtracks_stale)
+{
+}
+
+/** Kind byte of a descriptor (kind plus the scale-to-cell flag). */
+byte FlowGridEngine::PackKind(const Item& it) {
+    return byte(it.kind) | (it.scale_to_cell ? SCALE_TO_CELL : 0);
+}
+
+/** Parameter slot of a descriptor; only the kind's own parameters are kept. */
+Point FlowGridEngine::PackParam(const Item& it) {
+    return it.kind == Kind::Spacer || it.kind == Kind::Gap ? Point(it.min_px, it.max_px)
+         : it.kind == Kind::Expander                        ? Point(it.weight, 0)
+         : IsGridLike(it.kind)                              ? Point(it.col, it.row)
+         :                                                    Point(0, 0);
+}
+
+/** Split a descriptor into the per-field arrays. */
+int FlowGridEngine::Add(const Item& it) {
+    int i = item_kind.GetCount();
+    item_kind.Add(PackKind(it));
+    item_cluster.Add(it.cluster);
+    item_size.Add(it.size);
+    item_param.Add(PackParam(it));
+    item_rect.Add(Rect(0,0,0,0));
+    if(it.kind != Kind::CtrlItem || it.cluster >= 0)
+        ++irregular;
+    ++model_gen;
+    return i;
+}
+
+/** Bulk append: each array grows once instead of geometrically. */
+int FlowGridEngine::Add(const Item *it, int count) {
+    int i = item_kind.GetCount();
+    Reserve(i + count);
+    for(int k = 0; k < count; ++k)
+        Add(it[k]);
+    return i;
+}
+
+/**
+ * Insert before item i: one block move per array. Line and cluster spans past
+ * i are shifted with the items, so the next pass can still stop at the first
+ * unchanged line after the insertion.
+ */
+void FlowGridEngine::Insert(int i, const Item& it) {
+    item_kind.Insert(i, PackKind(it));
+    item_cluster.Insert(i, it.cluster);
+    item_size.Insert(i, it.size);
+    item_param.Insert(i, PackParam(it));
+    item_rect.Insert(i, Rect(0,0,0,0));
+    if(it.kind != Kind::CtrlItem || it.cluster >= 0)
+        ++irregular;
+
+    auto Shift = [&](int& x) { if(x >= i && x < INT_MAX) ++x; };
+    for(Line& ln : lines) {
+        Shift(ln.start);
+        Shift(ln.end);
+    }
+    for(Cluster& cl : clusters) {
+        Shift(cl.first);
+        Shift(cl.last);
+    }
+    Shift(dirty_hi);
+    Invalidate(i, i);
+}
+
+/**
+ * Remove the items at ascending indices `sorted` in one sweep over each array.
+ * Spans are remapped (a boundary moves down by the removals before it) and
+ * lines left empty are dropped; clusters that lost items get their bounds
+ * recomputed by the next pass.
+ */
+void FlowGridEngine::Remove(const Vector<int>& sorted) {
+    if(sorted.IsEmpty())
+        return;
+    int j = sorted[0], k = 0;
+    for(int i = sorted[0]; i < GetCount(); ++i) {
+        if(k < sorted.GetCount() && sorted[k] == i) {
+            if(GetKind(i) != Kind::CtrlItem || item_cluster[i] >= 0)
+                --irregular;
+            if(item_cluster[i] >= 0)
+                stale_clusters.FindAdd(item_cluster[i]);
+            ++k;
+            continue;
+        }
+        item_kind[j]    = item_kind[i];
+        item_cluster[j] = item_cluster[i];
+        item_size[j]    = item_size[i];
+        item_param[j]   = item_param[i];
+        item_rect[j]    = item_rect[i];
+        ++j;
+    }
+    item_kind.Trim(j);
+    item_cluster.Trim(j);
+    item_size.Trim(j);
+    item_param.Trim(j);
+    item_rect.Trim(j);
+
+    auto Remap = [&](int& x) {
+        if(x <= sorted[0] || x == INT_MAX)
+            return;
+        int lo = 0, hi = sorted.GetCount(); // removals before x
+        while(lo < hi) {
+            int mid = (lo + hi) >> 1;
+            if(sorted[mid] < x)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        x -= lo;
+    };
+    int n = 0;
+    for(Line& ln : lines) {
+        Remap(ln.start);
+        Remap(ln.end);
+        if(ln.start < ln.end)
+            lines[n++] = ln;
+    }
+    lines.Trim(n);
+    for(Cluster& cl : clusters) {
+        Remap(cl.first);
+        Remap(cl.last);
+    }
+    // Lines may only be reused after the last removal point
+    Invalidate(sorted[0], sorted.Top() - (sorted.GetCount() - 1));
+}
+
+/** Move item `from` to index `to`; only items in between change index. */
+void FlowGridEngine::Move(int from, int to) {
+    if(from == to)
+        return;
+    if(item_cluster[from] >= 0)
+        stale_clusters.FindAdd(item_cluster[from]);
+    auto MoveOne = [&](auto& v) {
+        auto x = v[from];
+        v.Remove(from);
+        v.Insert(to, x);
+    };
+    MoveOne(item_kind);
+    MoveOne(item_cluster);
+    MoveOne(item_size);
+    MoveOne(item_param);
+    MoveOne(item_rect);
+    Invalidate(min(from, to), max(from, to));
+}
+
+/** Drop every item (clusters are kept); the next Layout is a full pass. */
+void FlowGridEngine::Clear() {
+    item_kind.Clear();
+    item_cluster.Clear();
+    item_size.Clear();
+    item_param.Clear();
+    item_rect.Clear();
+    irregular = 0;
+    lines.Clear();
+    grid_cells.Clear();
+    stale_clusters.Clear();
+    Invalidate();
+}
+
+void FlowGridEngine::Reserve(int n) {
+    item_kind.Reserve(n);
+    item_cluster.Reserve(n);
+    item_size.Reserve(n);
+    item_param.Reserve(n);
+    item_rect.Reserve(n);
+}
+
+/** Reassemble the descriptor of item i; parameters of other kinds read as defaults. */
+FlowGridEngine::Item FlowGridEngine::Get(int i) const {
+    Item it;
+    it.kind          = GetKind(i);
+    it.cluster       = item_cluster[i];
+    it.size          = item_size[i];
+    it.scale_to_cell = item_kind[i] & SCALE_TO_CELL;
+    if(it.kind == Kind::Spacer || it.kind == Kind::Gap) {
+        it.min_px = MinPx(i);
+        it.max_px = MaxPx(i);
+    }
+    else
+    if(it.kind == Kind::Expander)
+        it.weight = Weight(i);
+    else
+    if(IsGridLike(it.kind)) {
+        it.col = Col(i);
+        it.row = Row(i);
+    }
+    return it;
+}
+
+/** Ensure cluster index exists; return normalized id or -1 for "none". */
+int FlowGridEngine::EnsureCluster(int id) {
+    if(id < 0) return -1;
+    if(id >= clusters.GetCount())
+        ++model_gen;
+    while(id >= clusters.GetCount())
+        clusters.Add(Cluster());
+    return id;
+}
+
+/** Natural size of an item (unified, measured control size, or spacer/gap minimum). */
+Size FlowGridEngine::Natural(int i, const Options& o) const {
+    if(o.unified)
+        return o.unified_sz;
+    Kind k = GetKind(i);
+    if(IsCtrl(k))
+        return item_size[i];
+    if(k == Kind::Spacer || k == Kind::Gap)
+        return o.horz ? Size(MinPx(i), o.hairline) : Size(o.hairline, MinPx(i));
+    if(k == Kind::Expander)
+        return o.horz ? Size(0, o.hairline) : Size(o.hairline, 0);
+    return Size(0,0);
+}
+
+//==============================================================================
+// Layout dispatch
+//==============================================================================
+
+/** Layout dispatcher: virtual vs Grid vs Flow; records the re-placed item range. */
+void FlowGridEngine::Layout(const Rect& view, const Options& o) {
+    Rect r = view.Deflated(o.padding);
+
+    // Anything that moves every cell forces a full pass; otherwise resume
+    // from the first dirty item (or skip the pass when nothing is dirty).
+    bool full = dirty_lo == 0 || r != inner || o != opt;
+    opt   = o;
+    inner = r;
+    done_lo = done_hi = 0;
+    uniform = IsUniform(o);
+
+    if(uniform) {
+        LayoutUniform();
+        done_hi = opt.virt ? 0 : GetCount();
+    }
+    else
+    if(opt.virt && opt.vgrid)
+        LayoutVirtualGrid();
+    else
+    if(opt.virt)
+        LayoutVirtual();
+    else
+    if(opt.grid) {
+        LayoutGrid();
+        done_hi = GetCount();
+    }
+    else {
+        if(lines.IsEmpty())
+            full = true;
+        if(full || dirty_lo < INT_MAX)
+            LayoutFlow(full);
+        grid_cells.Clear();
+    }
+    dirty_lo = INT_MAX;
+    dirty_hi = -1;
+    stale_clusters.Clear(); // full passes rebuild every cluster
+}
+
+/** Conservative natural size (see FlowGridLayout::GetMinSize); includes padding. */
+Size FlowGridEngine::GetMinSize(int width, const Options& o) const {
+    // ---------- Virtual tiles: envelope of the last layout ----------
+    if(o.virt && (o.vgrid || !(o.horz && o.wrap)))
+        return content;
+
+    // ---------- Grid envelope ----------
+    if(o.grid && !o.virt) {
+        GridTracks t;
+        BuildGridTracks(t, Point(0, 0), o);
+        return Size(t.Width() + 2*o.padding, t.Height() + 2*o.padding);
+    }
+
+    // ---------- Flow envelope ----------
+    const int gap = o.spacing;
+
+    // Unified tiles: the stack and single-line sums are closed-form
+    if(IsUniform(o) && !(o.horz && o.wrap)) {
+        int  n   = GetCount();
+        Size sz  = o.unified_sz;
+        int  sum = n ? n * (o.horz ? sz.cx : sz.cy) + (n - 1) * gap : 0;
+        int  ext = n ? (o.horz ? sz.cy : sz.cx) : 0;
+        return o.horz ? Size(sum + 2*o.padding, ext + 2*o.padding)
+                      : Size(ext + 2*o.padding, sum + 2*o.padding);
+    }
+
+    auto NaturalW = [&](int i)->int {
+        Kind k = GetKind(i);
+        if(k == Kind::Spacer || k == Kind::Gap)   return MinPx(i);
+        if(k == Kind::Expander)                    return 0;
+        return Natural(i, o).cx;
+    };
+    auto NaturalH = [&](int i)->int {
+        Kind k = GetKind(i);
+        if(k == Kind::Spacer || k == Kind::Gap)   return MinPx(i);
+        if(k == Kind::Expander)                    return 0;
+        return Natural(i, o).cy;
+    };
+
+    // Flow, Left-to-right, wrapping: height-for-width probe like FlowBox.
+    if(o.horz && o.wrap)
+        return Size(width, max(MeasureHeightForWidth(width, o), 0));
+
+    // Flow, Top-to-bottom (stack): sum heights (+gaps), width = max width.
+    if(!o.horz) {
+        int sumh = 0, maxw = 0, count = 0;
+        for(int i = 0; i < GetCount(); ++i) {
+            if(!IsFlowRenderable(GetKind(i))) continue;
+            if(count) sumh += gap;
+            sumh += NaturalH(i);
+            maxw = max(maxw, NaturalW(i));
+            ++count;
+        }
+        return Size(maxw + 2*o.padding, sumh + 2*o.padding);
+    }
+
+    // Flow, Left-to-right, no wrap: sum widths (+gaps), height = max height.
+    int sumw = 0, maxh = 0, count = 0;
+    for(int i = 0; i < GetCount(); ++i) {
+        if(!IsFlowRenderable(GetKind(i))) continue;
+        if(count) sumw += gap;
+        sumw += NaturalW(i);
+        maxh = max(maxh, NaturalH(i));
+        ++count;
+    }
+    return Size(sumw + 2*o.padding, maxh + 2*o.padding);
+}
+
+//==============================================================================
+// Grid tracks
+//==============================================================================
+
+/** Slot of an occupied track (binary search), or -1 for an empty one. */
+int FlowGridEngine::TrackAxis::Slot(int track) const {
+    int lo = 0, hi = index.GetCount();
+    while(lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if(index[mid] < track)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < index.GetCount() && index[lo] == track ? lo : -1;
+}
+
+/** Leading edge of a track in dense numbering: every track before it adds one
+    gap, occupied ones also their size. Offset(count) is the far edge. */
+int FlowGridEngine::TrackAxis::Offset(int track) const {
+    int lo = 0, hi = index.GetCount();
+    while(lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if(index[mid] < track)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int p = start + (sum.GetCount() ? sum[lo] : 0) + track * gap;
+    return count && track >= count ? p - gap : p;
+}
+
+/** Track whose [offset, offset + size) holds `pos`; empty tracks hold nothing. */
+int FlowGridEngine::TrackAxis::At(int pos) const {
+    int lo = 0, hi = index.GetCount();
+    while(lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if(SlotOffset(mid) <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int k = lo - 1;
+    return k >= 0 && pos < SlotOffset(k) + size[k] ? index[k] : -1;
+}
+
+/** First occupied slot whose trailing edge lies beyond `pos` (slot count if none). */
+int FlowGridEngine::TrackAxis::FirstSlotAfter(int pos) const {
+    int lo = 0, hi = index.GetCount();
+    while(lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if(SlotOffset(mid) + size[mid] <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/** Position of the first entry in grid_cells not ordered before (row, col). */
+int FlowGridEngine::LowerGridCell(int row, int col) const {
+    int lo = 0, hi = grid_cells.GetCount();
+    while(lo < hi) {
+        int mid = (lo + hi) >> 1;
+        int r = Row(grid_cells[mid]);
+        if(r < row || (r == row && Col(grid_cells[mid]) < col))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Collect the occupied tracks of one axis (sorted, unique), their natural sizes
+ * and size prefix sums. O(cells log cells), independent of the track numbers:
+ * a lone cell at row 500000 costs one slot, not half a million.
+ */
+void FlowGridEngine::BuildTrackAxis(TrackAxis& t, bool rows, int start, const Options& o) const {
+    t.index.Clear();
+    t.count = 0;
+    t.start = start;
+    t.gap   = o.spacing;
+    for(int i = 0; i < GetCount(); ++i) {
+        Kind k = GetKind(i);
+        if(IsGridLike(k)) {
+            int n = rows ? Row(i) : Col(i);
+            t.count = max(t.count, n + 1); // blank cells extend the grid but stay empty
+            if(k == Kind::GridCell)
+                t.index.Add(n);
+        }
+    }
+
+    Sort(t.index);
+    int n = 0;
+    for(int k = 0; k < t.index.GetCount(); ++k)
+        if(n == 0 || t.index[n - 1] != t.index[k])
+            t.index[n++] = t.index[k];
+    t.index.Trim(n);
+
+    t.size.Clear();
+    t.size.SetCount(n, 0);
+    for(int i = 0; i < GetCount(); ++i)
+        if(GetKind(i) == Kind::GridCell) {
+            Size ns = Natural(i, o);
+            int& sz = t.size[t.Slot(rows ? Row(i) : Col(i))];
+            sz = max(sz, rows ? ns.cy : ns.cx);
+        }
+
+    t.sum.SetCount(n + 1);
+    t.sum[0] = 0;
+    for(int k = 0; k < n; ++k)
+        t.sum[k + 1] = t.sum[k] + t.size[k];
+}
+
+/** Measure natural column widths/row heights and build their offset tables. */
+void FlowGridEngine::BuildGridTracks(GridTracks& t, Point start, const Options& o) const {
+    BuildTrackAxis(t.col, false, start.x, o);
+    BuildTrackAxis(t.row, true,  start.y, o);
+}
+
+/** Grid pass: build track offsets once, then place cells in O(cells). */
+void FlowGridEngine::LayoutGrid() {
+    BuildGridTracks(grid, inner.TopLeft(), opt);
+    grid_cells.Clear();
+
+    for(int i = 0; i < GetCount(); ++i) {
+        if(GetKind(i) != Kind::GridCell)
+            continue; // not laid out in Grid mode
+        grid_cells.Add(i);
+
+        int c = Col(i), r = Row(i);
+        item_rect[i] = RectC(grid.col.Offset(c), grid.row.Offset(r), grid.col.Size(c), grid.row.Size(r)); // cell area
+    }
+
+    content = Size(grid.Width() + 2 * opt.padding, grid.Height() + 2 * opt.padding);
+    lines.Clear();
+
+    // (row, col) order for hit-testing and range queries
+    Sort(grid_cells, [&](int a, int b) {
+        return Row(a) < Row(b) || (Row(a) == Row(b) && Col(a) < Col(b));
+    });
+}
+
+//==============================================================================
+// Closed form (unified tiles)
+//==============================================================================
+
+/** Uniform tiles with nothing between them: no spacers, breaks, grid cells or
+    clusters (virtual tiles never have those). */
+bool FlowGridEngine::IsUniform(const Options& o) const {
+    return o.unified && !o.grid && !(o.virt && o.vgrid) && (o.virt || irregular == 0);
+}
+
+/** Tiles per line: slot k fits when k * (len + gap) + len <= limit; never 0. */
+int FlowGridEngine::PerLine(int len, int limit, int gap, bool wrap, int count) {
+    if(!wrap || len + gap <= 0)
+        return max(count, 1);
+    return limit < len ? 1 : (limit - len) / (len + gap) + 1;
+}
+
+/** First slot (of size `len`, pitch `step`) whose far edge lies beyond `pos`. */
+int FlowGridEngine::FirstSlotAfter(int pos, int len, int step) {
+    return pos < len ? 0 : (pos - len) / step + 1;
+}
+
+/** Cell of the tile in `slot` of `line`. */
+Rect FlowGridEngine::UniformCell(int line, int slot) const {
+    const Size cell = opt.unified_sz;
+    const int  gap  = opt.spacing;
+    return opt.horz ? RectC(inner.left + slot * (cell.cx + gap), inner.top + line * (cell.cy + gap), cell.cx, cell.cy)
+                    : RectC(inner.left + line * (cell.cx + gap), inner.top + slot * (cell.cy + gap), cell.cx, cell.cy);
+}
+
+/** Tile at a content point by division; -1 in gaps and past the last tile. */
+int FlowGridEngine::UniformItemAt(Point p) const {
+    const bool horz = opt.horz;
+    const Size cell = opt.unified_sz;
+    const int  len  = horz ? cell.cx : cell.cy, ext = horz ? cell.cy : cell.cx;
+    const int  m    = horz ? p.x - inner.left : p.y - inner.top;
+    const int  c    = horz ? p.y - inner.top  : p.x - inner.left;
+    if(m < 0 || c < 0 || len <= 0 || ext <= 0)
+        return -1;
+    int k = m / (len + opt.spacing), l = c / (ext + opt.spacing);
+    if(k >= per_line || m - k * (len + opt.spacing) >= len || c - l * (ext + opt.spacing) >= ext)
+        return -1;
+    int i = l * per_line + k;
+    return i < uniform_count ? i : -1;
+}
+
+/**
+ * Closed-form pass: tile i sits in line i / per_line at slot i % per_line, so
+ * only the per-line count and the content size are computed. Matches the flow
+ * and virtual passes (the flow wrap test allows one pixel of overhang).
+ */
+void FlowGridEngine::LayoutUniform() {
+    const bool horz = opt.horz;
+    const Size cell = opt.unified_sz;
+    const int  gap  = opt.spacing;
+    const int  len  = horz ? cell.cx : cell.cy, ext = horz ? cell.cy : cell.cx;
+    const int  lim  = horz ? inner.GetWidth() : inner.GetHeight();
+
+    uniform_count = opt.virt ? vcount : GetCount();
+    per_line      = PerLine(len, opt.virt ? lim : lim + 1, gap, opt.wrap, uniform_count);
+
+    int k = min(uniform_count, per_line);
+    int l = (uniform_count + per_line - 1) / per_line;
+    int used  = k ? k * len + (k - 1) * gap : 0;
+    int cross = l ? l * ext + (l - 1) * gap : 0;
+    content = horz ? Size(used  + 2*opt.padding, cross + 2*opt.padding)
+                   : Size(cross + 2*opt.padding, used  + 2*opt.padding);
+
+    lines.Clear();
+    vlines.Clear();
+    grid_cells.Clear();
+    ResetClusters();
+}
+
+//==============================================================================
+// Virtual tiles
+//==============================================================================
+
+/** Natural size of a virtual tile (unified sizing wins, like real items). */
+Size FlowGridEngine::VirtualSize(int i, const Options& o) const {
+    if(o.unified)
+        return o.unified_sz;
+    if(i < vfrozen.GetCount())
+        return vfrozen[i];
+    return vsize ? vsize(i) : Size(0,0);
+}
+
+/** Capture every tile size so later passes never invoke vsize. */
+void FlowGridEngine::FreezeVirtualSizes() {
+    SyncVirtualTracks(); // the copied tracks then never call back either
+    vrow_size.Clear();
+    vcol_size.Clear();
+    if(!vsize)
+        return;
+    vfrozen.SetCount(vcount);
+    for(int i = 0; i < vcount; ++i)
+        vfrozen[i] = vsize(i);
+    vsize.Clear();
+}
+
+//==============================================================================
+// Virtual grid
+//==============================================================================
+
+/** Size the first n tracks (tracks below `keep` retain their current size) and
+    rebuild the tree in O(n). */
+void FlowGridEngine::FenwickTracks::Build(int n, const Function<int(int)>& fn, int keep) {
+    int k = min(keep, n);
+    size.SetCount(n);
+    for(int i = k; i < n; ++i)
+        size[i] = fn ? max(fn(i), 0) : 0;
+    tree.SetCount(n + 1);
+    tree[0] = 0;
+    for(int i = 1; i <= n; ++i)
+        tree[i] = size[i - 1];
+    for(int i = 1; i <= n; ++i) {
+        int j = i + (i & -i);
+        if(j <= n)
+            tree[j] += tree[i];
+    }
+}
+
+/** Change one track size: O(log n) tree nodes. */
+void FlowGridEngine::FenwickTracks::Set(int i, int sz) {
+    int d = sz - size[i];
+    size[i] = sz;
+    for(int j = i + 1; j < tree.GetCount(); j += j & -j)
+        tree[j] += d;
+}
+
+/** Sizes of tracks [0, i) plus one gap each. */
+int FlowGridEngine::FenwickTracks::Offset(int i, int gap) const {
+    int s = 0;
+    for(int j = min(i, GetCount()); j > 0; j -= j & -j)
+        s += tree[j];
+    return s + i * gap;
+}
+
+/** Fenwick descent: the last track whose leading edge is at or before pos. */
+int FlowGridEngine::FenwickTracks::Find(int pos, int gap) const {
+    const int n = GetCount();
+    if(pos < 0 || n == 0)
+        return -1;
+    int step = 1;
+    while(2 * step <= n)
+        step *= 2;
+    int i = 0, acc = 0;
+    for(; step; step >>= 1) // node i + step covers tracks (i, i + step]
+        if(i + step <= n && acc + tree[i + step] + step * gap <= pos) {
+            i += step;
+            acc += tree[i] + step * gap;
+        }
+    return min(i, n - 1);
+}
+
+/** First track whose trailing edge lies beyond pos (count if none). */
+int FlowGridEngine::FenwickTracks::FirstAfter(int pos, int gap) const {
+    int i = Find(pos, gap);
+    if(i < 0)
+        return 0;
+    return pos < Offset(i, gap) + size[i] ? i : i + 1;
+}
+
+/** Bring the track trees in line with vrows/vcols. Count changes keep the sizes
+    already known (including corrections), so only new tracks are queried. */
+void FlowGridEngine::SyncVirtualTracks() {
+    if(!vtracks_stale && vtrack_rows.GetCount() == vrows && vtrack_cols.GetCount() == vcols)
+        return;
+    vtrack_rows.Build(max(vrows, 0), vrow_size, vtracks_stale ? 0 : vtrack_rows.GetCount());
+    vtrack_cols.Build(max(vcols, 0), vcol_size, vtracks_stale ? 0 : vtrack_cols.GetCount());
+    vtracks_stale = false;
+    ++model_gen;
+}
+
+/** Replace one track size (e.g. an estimate by a measurement); O(log n). Syncs
+    the trees first, so a correction made before the next layout (after a grid
+    change or growth) is not overwritten or dropped by that layout's sync. */
+void FlowGridEngine::SetVirtualTrackSize(bool row, int i, int size) {
+    SyncVirtualTracks();
+    FenwickTracks& t = row ? vtrack_rows : vtrack_cols;
+    size = max(size, 0);
+    if(i >= 0 && i < t.GetCount() && t.size[i] != size) {
+        t.Set(i, size);
+        ++model_gen;
+    }
+}
+
+/** Virtual grid pass: tracks are already summed, so only the extent is computed. */
+void FlowGridEngine::LayoutVirtualGrid() {
+    SyncVirtualTracks();
+    content = Size(vtrack_cols.Extent(opt.spacing) + 2*opt.padding,
+                   vtrack_rows.Extent(opt.spacing) + 2*opt.padding);
+    lines.Clear();
+    vlines.Clear();
+    grid_cells.Clear();
+}
+
+/**
+ * Break virtual tiles into lines of at most `limit` main-axis pixels.
+ * Only the line table is stored; tile positions inside a line are walked on
+ * demand. Returns the widest line's main-axis extent.
+ */
+int FlowGridEngine::BuildVirtualLines(const Options& o, int limit, int cross0, Vector<Line>& out) const {
+    const bool horz = o.horz;
+    const int  gap  = o.spacing;
+
+    out.Clear();
+    Line ln;
+    ln.pos = cross0;
+    int used = 0, max_used = 0;
+    for(int i = 0; i < vcount; ++i) {
+        Size sz = VirtualSize(i, o);
+        int m = horz ? sz.cx : sz.cy;
+        int c = horz ? sz.cy : sz.cx;
+        if(i > ln.start) {
+            if(o.wrap && used + gap + m > limit) {
+                ln.end = i;
+                out.Add(ln);
+                max_used = max(max_used, used);
+                ln.pos += ln.extent + gap;
+                ln.start = i;
+                ln.extent = 0;
+                used = m;
+            }
+            else
+                used += gap + m;
+        }
+        else
+            used = m;
+        ln.extent = max(ln.extent, c);
+    }
+    if(vcount > 0) {
+        ln.end = vcount;
+        out.Add(ln);
+        max_used = max(max_used, used);
+    }
+    return max_used;
+}
+
+/** Index of the first line whose far edge lies beyond `pos` (lines sorted by pos). */
+int FlowGridEngine::FirstLineAfter(const Vector<Line>& lines, int pos) {
+    int lo = 0, hi = lines.GetCount();
+    while(lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if(lines[mid].pos + lines[mid].extent <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/** Geometry-only pass: rebuild the line table and content size. */
+void FlowGridEngine::LayoutVirtual() {
+    const bool horz = opt.horz;
+    int used  = BuildVirtualLines(opt, horz ? inner.GetWidth() : inner.GetHeight(), horz ? inner.top : inner.left, vlines);
+    int cross = vlines.GetCount() ? vlines.Top().pos + vlines.Top().extent - (horz ? inner.top : inner.left) : 0;
+    content = horz ? Size(used  + 2*opt.padding, cross + 2*opt.padding)
+                   : Size(cross + 2*opt.padding, used  + 2*opt.padding);
+}
+
+//==============================================================================
+// Geometry queries
+//==============================================================================
+
+/** First item of a flow line whose cell trails beyond `pos` on the main axis.
+    Cells in a line advance monotonically, so this is a binary search. */
+int FlowGridEngine::LineItemAfter(const Line& ln, int pos) const {
+    const bool horz = opt.horz;
+    int lo = ln.start, hi = ln.end;
+    while(lo < hi) {
+        int mid = (lo + hi) >> 1;
+        const Rect& r = item_rect[mid];
+        if((horz ? r.right : r.bottom) <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/** Item at a content point: line (or row/column) search, then a search within it. */
+int FlowGridEngine::ItemAt(Point cp) const {
+    if(uniform)
+        return UniformItemAt(cp);
+
+    if(opt.virt) {
+        int hit = -1;
+        VisitVirtual(RectC(cp.x, cp.y, 1, 1), [&](int i, const Rect& r) {
+            if(r.Contains(cp))
+                hit = i;
+        });
+        return hit;
+    }
+
+    if(opt.grid) {
+        int row = FindRow(cp.y), col = FindColumn(cp.x);
+        if(row < 0 || col < 0)
+            return -1;
+        int k = LowerGridCell(row, col);
+        if(k < grid_cells.GetCount()) {
+            int i = grid_cells[k];
+            if(Row(i) == row && Col(i) == col)
+                return i;
+        }
+        return -1;
+    }
+
+    const bool horz = opt.horz;
+    const int  cross = horz ? cp.y : cp.x, main = horz ? cp.x : cp.y;
+    int l = FirstLineAfter(lines, cross);
+    if(l >= lines.GetCount() || lines[l].pos > cross)
+        return -1;
+    const Line& ln = lines[l];
+    for(int i = LineItemAfter(ln, main); i < ln.end; ++i) {
+        const Rect& r = item_rect[i];
+        if((horz ? r.left : r.top) > main)
+            break;
+        if(IsFlowRenderable(GetKind(i)) && r.Contains(cp))
+            return i;
+    }
+    return -1;
+}
+
+/** Items intersecting a content rect; cost is proportional to the lines/rows it spans. */
+void FlowGridEngine::ItemsIn(const Rect& q, Vector<int>& out) const {
+    if(uniform || opt.virt) {
+        VisitVirtual(q, [&](int i, const Rect&) { out.Add(i); });
+        return;
+    }
+
+    if(opt.grid) {
+        // Only occupied rows hold cells; empty runs between them are skipped
+        const TrackAxis& cols = grid.col;
+        const TrackAxis& rows = grid.row;
+        int s0 = cols.FirstSlotAfter(q.left);
+        int c0 = s0 < cols.index.GetCount() ? cols.index[s0] : INT_MAX;
+        for(int s = rows.FirstSlotAfter(q.top); s < rows.index.GetCount() && rows.SlotOffset(s) < q.bottom; ++s)
+            for(int row = rows.index[s], k = LowerGridCell(row, c0); k < grid_cells.GetCount(); ++k) {
+                int i = grid_cells[k];
+                if(Row(i) != row || item_rect[i].left >= q.right)
+                    break;
+                if(item_rect[i].Intersects(q))
+                    out.Add(i);
+            }
+        return;
+    }
+
+    const bool horz = opt.horz;
+    for(int l = FirstLineAfter(lines, horz ? q.top : q.left); l < lines.GetCount(); ++l) {
+        const Line& ln = lines[l];
+        if(ln.pos >= (horz ? q.bottom : q.right))
+            break;
+        for(int i = LineItemAfter(ln, horz ? q.left : q.top); i < ln.end; ++i) {
+            const Rect& r = item_rect[i];
+            if((horz ? r.left : r.top) >= (horz ? q.right : q.bottom))
+                break;
+            if(IsFlowRenderable(GetKind(i)) && r.Intersects(q))
+                out.Add(i);
+        }
+    }
+}
+
+/** Cell rect of an item; virtual tiles walk only the line holding them. */
+Rect FlowGridEngine::GetItemRect(int index) const {
+    if(uniform)
+        return index >= 0 && index < uniform_count ? UniformCell(index / per_line, index % per_line) : Rect(0,0,0,0);
+
+    if(!opt.virt)
+        return index >= 0 && index < GetCount() ? item_rect[index] : Rect(0,0,0,0);
+
+    if(opt.vgrid) {
+        const int nc = vtrack_cols.GetCount();
+        if(index < 0 || nc == 0 || index / nc >= vtrack_rows.GetCount())
+            return Rect(0,0,0,0);
+        int row = index / nc, col = index % nc, gap = opt.spacing;
+        return RectC(inner.left + vtrack_cols.Offset(col, gap), inner.top + vtrack_rows.Offset(row, gap),
+                     vtrack_cols.size[col], vtrack_rows.size[row]);
+    }
+
+    if(index < 0 || index >= vcount || vlines.IsEmpty())
+        return Rect(0,0,0,0);
+
+    int lo = 0, hi = vlines.GetCount();
+    while(lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if(vlines[mid].start <= index)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    const Line& ln = vlines[max(lo - 1, 0)];
+
+    const bool horz = opt.horz;
+    int m = horz ? inner.left : inner.top;
+    for(int i = ln.start; i < index; ++i) {
+        Size sz = VirtualSize(i, opt);
+        m += (horz ? sz.cx : sz.cy) + opt.spacing;
+    }
+    Size sz = VirtualSize(index, opt);
+    return horz ? RectC(m, ln.pos, sz.cx, ln.extent) : RectC(ln.pos, m, ln.extent, sz.cy);
+}
+
+/** Control rect of an item, derived from its cell: grid cells are anchored at the
+    top-left corner, flow cells follow the cross-axis alignment. */
+Rect FlowGridEngine::GetPlace(int i) const {
+    if(opt.virt || i < 0 || i >= GetCount() || !IsCtrl(GetKind(i)))
+        return Rect(0,0,0,0);
+    if(uniform)
+        return PlaceInCell(i, GetItemRect(i));
+    const Rect& cell = item_rect[i];
+    if(!opt.grid)
+        return PlaceInCell(i, cell);
+    if(GetKind(i) != Kind::GridCell)
+        return Rect(0,0,0,0);
+
+    // Control size: either scaled to cell or natural clamped to cell
+    Size want = item_kind[i] & SCALE_TO_CELL ? cell.GetSize() : Natural(i, opt);
+    want.cx = min(want.cx, cell.GetWidth());
+    want.cy = min(want.cy, cell.GetHeight());
+    return RectC(cell.left, cell.top, want.cx, want.cy);
+}
+
+//==============================================================================
+// Flow passes (LeftToRight / TopToBottom)
+//==============================================================================
+
+/** Line to restart an incremental pass at: the one before the line holding
+    dirty_lo, since a shrunk item may now fit on the previous line. */
+int FlowGridEngine::ResumeLine() const {
+    int lo = 0, hi = lines.GetCount();
+    while(lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if(lines[mid].start <= dirty_lo)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return max(0, lo - 2);
+}
+
+/** Forget cluster bounds and item spans before a full flow pass. */
+void FlowGridEngine::ResetClusters() {
+    for(Cluster& cl : clusters) {
+        cl.bounds = Rect(0,0,0,0);
+        cl.first  = INT_MAX;
+        cl.last   = -1;
+    }
+}
+
+/** Record a placed cell of cluster `id`; incremental passes defer the union. */
+void FlowGridEngine::NoteClusterCell(int id, int i, const Rect& cell, bool full, Index<int>& touched) {
+    Cluster& cl = clusters[id];
+    cl.first = min(cl.first, i);
+    cl.last  = max(cl.last, i);
+    if(full)
+        cl.bounds = cl.bounds.IsEmpty() ? cell : (cl.bounds | cell);
+    else
+        touched.FindAdd(id);
+}
+
+/** Rebuild one cluster's bounds from the items in its span. */
+void FlowGridEngine::RecomputeClusterBounds(int id) {
+    Cluster& cl = clusters[id];
+    cl.bounds = Rect(0,0,0,0);
+    for(int i = cl.first; i <= cl.last && i < GetCount(); ++i) {
+        if(item_cluster[i] != id || !IsFlowRenderable(GetKind(i)))
+            continue;
+        cl.bounds = cl.bounds.IsEmpty() ? item_rect[i] : (cl.bounds | item_rect[i]);
+    }
+}
+
+/** Content size from the line table: farthest line by widest line reach. */
+Size FlowGridEngine::FlowContentSize() const {
+    const bool horz = opt.horz;
+    if(lines.IsEmpty())
+        return Size(2*opt.padding, 2*opt.padding);
+    int reach = 0;
+    for(const Line& ln : lines) {
+        const Rect& r = item_rect[ln.end - 1]; // cells advance monotonically
+        reach = max(reach, horz ? r.right - inner.left : r.bottom - inner.top);
+    }
+    const Line& last = lines.Top();
+    int cross = last.pos + last.extent - (horz ? inner.top : inner.left);
+    return horz ? Size(reach + 2*opt.padding, cross + 2*opt.padding)
+                : Size(cross + 2*opt.padding, reach + 2*opt.padding);
+}
+
+/** Control rectangle within a flow cell based on cross-axis alignment. */
+Rect FlowGridEngine::PlaceInCell(int i, const Rect& cell) const {
+    if(item_kind[i] & SCALE_TO_CELL)
+        return cell;
+
+    Size want = Natural(i, opt);
+    want.cx = min(want.cx, cell.GetWidth());
+    want.cy = min(want.cy, cell.GetHeight());
+
+    Rect cr = cell;
+    if(opt.horz) {
+        cr.right = cell.left + want.cx;
+        switch(opt.align) {
+            case Stretch:
+                break;
+            case Start:
+                cr.bottom = cell.top + want.cy;
+                break;
+            case End:
+                cr.top = cr.bottom - want.cy;
+                break;
+            case Center:
+            case Auto:
+            default:
+                cr.top = cell.top + (cell.GetHeight() - want.cy)/2;
+                cr.bottom = cr.top + want.cy;
+                break;
+        }
+    }
+    else {
+        cr.bottom = cell.top + want.cy;
+        switch(opt.align) {
+            case Stretch:
+                break;
+            case Start:
+                cr.right = cell.left + want.cx;
+                break;
+            case End:
+                cr.left = cr.right - want.cx;
+                break;
+            case Center:
+            case Auto:
+            default:
+                cr.left = cell.left + (cell.GetWidth() - want.cx)/2;
+                cr.right = cr.left + want.cx;
+                break;
+        }
+    }
+    return cr;
+}
+
+/**
+ * Flow pass (wrap-aware). Computes content size.
+ * When `full` is false, resumes at the line checkpoint before the first dirty
+ * item and stops as soon as a new line starts where an old, clean one did.
+ */
+void FlowGridEngine::LayoutFlow(bool full) {
+    if(full && LayoutSegments())
+        return;
+
+    FlowRun run;
+    run.to   = GetCount();
+    run.pos  = opt.horz ? inner.top : inner.left;
+    run.full = full;
+    run.out  = &lines;
+    if(full) {
+        ResetClusters();
+        lines.Clear();
+    }
+    else {
+        int resume = ResumeLine();
+        for(int l = resume; l < lines.GetCount(); ++l)
+            run.old.Add(lines[l]);
+        lines.Trim(resume);
+        run.pos  = run.old[0].pos;
+        run.from = run.old[0].start;
+        run.touched = pick(stale_clusters); // lost items to Remove()
+    }
+    done_lo = run.from;
+    if(opt.horz)
+        LayoutHorizontal(run);
+    else
+        LayoutVertical(run);
+    done_hi = run.stop >= 0 ? run.stop : GetCount();
+
+    for(int k = 0; k < run.touched.GetCount(); ++k)
+        RecomputeClusterBounds(run.touched[k]);
+    content = FlowContentSize();
+}
+
+/**
+ * Parallel full flow pass. A Break resets all line state, so each segment
+ * between Breaks depends only on where it starts: workers break and place
+ * the segments from the leading edge, a prefix sum over segment extents
+ * gives their real starts, and a second parallel sweep shifts the cells.
+ * Returns false, having done nothing, when the pass is too small to split.
+ */
+bool FlowGridEngine::LayoutSegments() {
+    const int n = GetCount();
+    const int cores = CPU_Cores();
+    if(n < PARALLEL_MIN_ITEMS || cores < 2)
+        return false;
+
+    Vector<int> cut;    // segment starts, then n
+    cut.Add(0);
+    for(int i = 0; i + 1 < n; ++i)
+        if(GetKind(i) == Kind::Break)
+            cut.Add(i + 1);
+    const int segs = cut.GetCount();
+    if(segs < 2)
+        return false;
+    cut.Add(n);
+
+    // Batch small segments so each job carries a fair share of the items
+    const int chunk = max(PARALLEL_MIN_ITEMS / 4, n / (4 * cores));
+    Vector<int> batch;
+    for(int k = 0; k < segs;) {
+        batch.Add(k);
+        int b = k + 1;
+        while(b < segs && cut[b] - cut[k] < chunk)
+            ++b;
+        k = b;
+    }
+    batch.Add(segs);
+
+    const int origin = opt.horz ? inner.top : inner.left;
+    Array<FlowRun>       run;
+    Vector<Vector<Line>> part;
+    run.SetCount(segs);
+    part.SetCount(segs);
+    CoWork co;
+    for(int b = 0; b + 1 < batch.GetCount(); ++b)
+        co & [=, &run, &part, &cut, &batch] {
+            for(int k = batch[b]; k < batch[b + 1]; ++k) {
+                FlowRun& r = run[k];
+                r.from = cut[k];
+                r.to   = cut[k + 1];
+                r.pos  = origin;
+                r.note = false;
+                r.out  = &part[k];
+                if(opt.horz)
+                    LayoutHorizontal(r);
+                else
+                    LayoutVertical(r);
+            }
+        };
+    co.Finish();
+
+    Vector<int> shift;  // segment start minus origin
+    shift.SetCount(segs);
+    int pos = origin;
+    int count = 0;
+    for(int k = 0; k < segs; ++k) {
+        shift[k] = pos - origin;
+        pos += run[k].pos - origin;
+        count += part[k].GetCount();
+    }
+
+    const bool horz = opt.horz;
+    for(int b = 0; b + 1 < batch.GetCount(); ++b)
+        co & [=, &part, &shift, &batch] {
+            for(int k = batch[b]; k < batch[b + 1]; ++k) {
+                const int d = shift[k];
+                if(d == 0)
+                    continue;
+                for(Line& ln : part[k]) {
+                    ln.pos += d;
+                    for(int i = ln.start; i < ln.end; ++i)
+                        if(GetKind(i) != Kind::Break)
+                            item_rect[i].Offset(horz ? 0 : d, horz ? d : 0);
+                }
+            }
+        };
+    co.Finish();
+
+    lines.Clear();
+    lines.Reserve(count);
+    for(const Vector<Line>& p : part)
+        lines.Append(p);
+
+    // Clusters may straddle a Break, so their bounds are gathered here
+    ResetClusters();
+    if(clusters.GetCount()) {
+        Index<int> none;
+        for(const Line& ln : lines)
+            for(int i = ln.start; i < ln.end; ++i)
+                if(item_cluster[i] >= 0 && GetKind(i) != Kind::Break)
+                    NoteClusterCell(item_cluster[i], i, item_rect[i], true, none);
+    }
+    done_lo = 0;
+    done_hi = n;
+    content = FlowContentSize();
+    return true;
+}
+
+/**
+ * Line breaker for LeftToRight direction: lays out items [run.from, run.to)
+ * in rows starting at y = run.pos and leaves the next row's y in run.pos.
+ * Writes no item outside the run, so segments can run concurrently.
+ */
+void FlowGridEngine::LayoutHorizontal(FlowRun& run) {
+    const Rect vr = inner;
+    const int  spacing = opt.spacing;
+    const bool full = run.full;
+    const int  to = run.to;
+    const Vector<Line>& old = run.old;
+    Vector<Line>& out = *run.out;
+    int x = vr.left, y = run.pos;
+    int line_h = 0;
+    int line_start = run.from;
+
+    // True when a line starting at `s` (at the current y) matches a clean old line.
+    int o = 1;
+    auto Matches = [&](int s) -> bool {
+        if(full || s <= dirty_hi)
+            return false;
+        while(o < old.GetCount() && old[o].start < s)
+            ++o;
+        return o < old.GetCount() && old[o].start == s && old[o].pos == y;
+    };
+    bool stopped = false;
+
+    // Commit a laid-out line [from, to)
+    auto CommitLine = [&](int from, int to, int free_px) {
+        Line& ln = out.Add();
+        ln.start  = from;
+        ln.end    = to;
+        ln.pos    = y;
+        ln.extent = line_h;
+
+        // distribute to spacers
+        int count_sp = 0; for(int i=from;i<to;i++) if(GetKind(i)==Kind::Spacer) count_sp++;
+        if(count_sp) {
+            for(int i=from;i<to;i++) if(GetKind(i)==Kind::Spacer) {
+                int grow = min(MaxPx(i) - MinPx(i), free_px / max(count_sp,1));
+                item_rect[i].SetSize(Size(MinPx(i) + max(0,grow), line_h));
+                free_px -= max(0,grow);
+            }
+        }
+        // expanders proportionally
+        int wsum = 0; for(int i=from;i<to;i++) if(GetKind(i)==Kind::Expander) wsum += max(1, Weight(i));
+        if(wsum > 0 && free_px > 0) {
+            for(int i=from;i<to;i++) if(GetKind(i)==Kind::Expander) {
+                int got = free_px * max(1, Weight(i)) / wsum;
+                item_rect[i].SetSize(Size(got, line_h));
+            }
+        }
+        // place cells and controls
+        int lx = vr.left;
+        for(int i=from;i<to;i++) {
+            if(GetKind(i) == Kind::Break) continue; // nothing to render
+
+            // Cell width (pre-sized by Spacer/Expander SetSize or natural)
+            Size ns_base = item_rect[i].GetSize();
+            if(ns_base.cx == 0 || ns_base.cy == 0) {
+                Size nat = Natural(i, opt);
+                ns_base = Size((ns_base.cx ? ns_base.cx : nat.cx), line_h);
+            }
+            Rect cell = RectC(lx, y, ns_base.cx, line_h);
+            item_rect[i] = cell; // keep union basis for cluster bounds
+
+            if(item_cluster[i] >= 0)
+                if(run.note)
+                    NoteClusterCell(item_cluster[i], i, cell, full, run.touched);
+            lx += cell.GetWidth() + spacing;
+        }
+    };
+
+    int used_w = 0;
+    line_h = 0;
+
+    auto NaturalW = [&](int i)->int {
+        Kind k = GetKind(i);
+        if(k==Kind::Spacer)   return MinPx(i);
+        if(k==Kind::Gap)      return MinPx(i);
+        if(k==Kind::Expander) return 0;
+        return Natural(i, opt).cx;
+    };
+
+    for(int i=line_start;i<to;++i) {
+        Kind k = GetKind(i);
+        if(k==Kind::GridCell || k==Kind::BlankGrid) continue;
+
+        // Hard break commits current line if there's content.
+        if(k == Kind::Break) {
+            if(i > line_start) {
+                int free_px = (vr.right - vr.left) - (used_w ? (used_w - spacing) : 0);
+                CommitLine(line_start, i, max(0, free_px));
+                y += line_h + spacing;
+                x = vr.left;
+                line_h = 0;
+                line_start = i + 1;
+                used_w = 0;
+                if(Matches(line_start)) { stopped = true; break; }
+            } else {
+                line_start = i + 1;
+            }
+            continue;
+        }
+
+        // Atomic cluster (no internal wrap)
+        int cid = item_cluster[i];
+        if(cid >= 0 && !clusters[cid].flow) {
+            int j=i, cw=0, ch=0;
+            while(j<to && item_cluster[j]==cid && IsFlowRenderable(GetKind(j))) {
+                cw += NaturalW(j);
+                ch = max(ch, Natural(j, opt).cy);
+                if(j>i) cw += spacing;
+                j++;
+            }
+            if(opt.wrap && (x + cw > vr.right+1) && i>line_start) {
+                int free_px = (vr.right - vr.left) - (used_w ? (used_w - spacing) : 0);
+                CommitLine(line_start, i, max(0, free_px));
+                y += line_h + spacing;
+                x = vr.left;
+                line_h = 0;
+                line_start = i;
+                used_w = 0;
+                if(Matches(line_start)) { stopped = true; break; }
+            }
+            for(int m=i;m<j;m++) {
+                Size ns = Natural(m, opt);
+                item_rect[m] = RectC(0,0, ns.cx, max(ns.cy, ch));
+                used_w += ns.cx + (m>i?spacing:0);
+                line_h = max(line_h, ns.cy);
+            }
+            x += cw + spacing;
+            i = j-1;
+            continue;
+        }
+
+        Size ns = Natural(i, opt);
+        int needw = NaturalW(i);
+        if(opt.wrap && x != vr.left && (x + needw > vr.right+1)) {
+            int free_px = (vr.right - vr.left) - (used_w ? (used_w - spacing) : 0);
+            CommitLine(line_start, i, max(0, free_px));
+            y += line_h + spacing;
+            x = vr.left;
+            line_h = 0;
+            line_start = i;
+            used_w = 0;
+            if(Matches(line_start)) { stopped = true; break; }
+        }
+        item_rect[i] = RectC(0,0, needw, ns.cy); // temp; finalized in CommitLine
+        used_w += needw + (i>line_start?spacing:0);
+        line_h = max(line_h, ns.cy);
+        x += needw + spacing;
+    }
+
+    if(stopped) {
+        // The rest of the old lines are still valid as-is.
+        for(int l = o; l < old.GetCount(); ++l)
+            out.Add(old[l]);
+        run.stop = line_start;
+    }
+    else
+    if(line_start < to) {
+        int free_px = (vr.right - vr.left) - (used_w ? (used_w - spacing) : 0);
+        CommitLine(line_start, to, max(0, free_px));
+    }
+    run.pos = y;
+}
+
+/** Line breaker for TopToBottom direction; mirrors LayoutHorizontal() with
+    columns for lines, starting at x = run.pos. */
+void FlowGridEngine::LayoutVertical(FlowRun& run) {
+    const Rect vr = inner;
+    const int  spacing = opt.spacing;
+    const bool full = run.full;
+    const int  to = run.to;
+    const Vector<Line>& old = run.old;
+    Vector<Line>& out = *run.out;
+    int x = run.pos, y = vr.top;
+    int line_w = 0;
+    int col_start = run.from;
+
+    // True when a column starting at `s` (at the current x) matches a clean old one.
+    int o = 1;
+    auto Matches = [&](int s) -> bool {
+        if(full || s <= dirty_hi)
+            return false;
+        while(o < old.GetCount() && old[o].start < s)
+            ++o;
+        return o < old.GetCount() && old[o].start == s && old[o].pos == x;
+    };
+    bool stopped = false;
+
+    // Commit a laid-out column [from, to)
+    auto CommitCol = [&](int from, int to, int free_px) {
+        Line& ln = out.Add();
+        ln.start  = from;
+        ln.end    = to;
+        ln.pos    = x;
+        ln.extent = line_w;
+
+        int count_sp = 0; for(int i=from;i<to;i++) if(GetKind(i)==Kind::Spacer) count_sp++;
+        if(count_sp) {
+            for(int i=from;i<to;i++) if(GetKind(i)==Kind::Spacer) {
+                int grow = min(MaxPx(i) - MinPx(i), free_px / max(count_sp,1));
+                item_rect[i].SetSize(Size(line_w, MinPx(i) + max(0,grow)));
+                free_px -= max(0,grow);
+            }
+        }
+        int wsum = 0; for(int i=from;i<to;i++) if(GetKind(i)==Kind::Expander) wsum += max(1, Weight(i));
+        if(wsum > 0 && free_px > 0) {
+            for(int i=from;i<to;i++) if(GetKind(i)==Kind::Expander) {
+                int got = free_px * max(1, Weight(i)) / wsum;
+                item_rect[i].SetSize(Size(line_w, got));
+            }
+        }
+        int ly = vr.top;
+        for(int i=from;i<to;i++) {
+            if(GetKind(i) == Kind::Break) continue;
+
+            Size ns_base = item_rect[i].GetSize();
+            if(ns_base.cx == 0 || ns_base.cy == 0) {
+                Size nat = Natural(i, opt);
+                ns_base = Size(line_w, (ns_base.cy ? ns_base.cy : nat.cy));
+            }
+            Rect cell = RectC(x, ly, line_w, ns_base.cy);
+            item_rect[i] = cell;
+
+            if(item_cluster[i] >= 0)
+                if(run.note)
+                    NoteClusterCell(item_cluster[i], i, cell, full, run.touched);
+            ly += cell.GetHeight() + spacing;
+        }
+    };
+
+    int used_h = 0;
+    line_w = 0;
+
+    auto NaturalH = [&](int i)->int {
+        Kind k = GetKind(i);
+        if(k==Kind::Spacer)   return MinPx(i);
+        if(k==Kind::Gap)      return MinPx(i);
+        if(k==Kind::Expander) return 0;
+        return Natural(i, opt).cy;
+    };
+
+    for(int i=col_start;i<to;++i) {
+        Kind k = GetKind(i);
+        if(k==Kind::GridCell || k==Kind::BlankGrid) continue;
+
+        if(k == Kind::Break) {
+            if(i > col_start) {
+                int free_px = (vr.bottom - vr.top) - (used_h ? (used_h - spacing) : 0);
+                CommitCol(col_start, i, max(0, free_px));
+                x += line_w + spacing;
+                y = vr.top;
+                col_start = i + 1;
+                used_h = 0;
+                line_w = 0;
+                if(Matches(col_start)) { stopped = true; break; }
+            } else {
+                col_start = i + 1;
+            }
+            continue;
+        }
+
+        int cid = item_cluster[i];
+        if(cid >= 0 && !clusters[cid].flow) {
+            int j=i, ch=0, cw=0;
+            while(j<to && item_cluster[j]==cid && IsFlowRenderable(GetKind(j))) {
+                ch += NaturalH(j);
+                cw = max(cw, Natural(j, opt).cx);
+                if(j>i) ch += spacing;
+                j++;
+            }
+            if(opt.wrap && (y + ch > vr.bottom+1) && i>col_start) {
+                int free_px = (vr.bottom - vr.top) - (used_h ? (used_h - spacing) : 0);
+                CommitCol(col_start, i, max(0, free_px));
+                x += line_w + spacing;
+                y = vr.top;
+                col_start = i;
+                used_h = 0;
+                line_w = 0;
+                if(Matches(col_start)) { stopped = true; break; }
+            }
+            for(int m=i;m<j;m++) {
+                Size ns = Natural(m, opt);
+                item_rect[m] = RectC(0,0, max(cw, ns.cx), ns.cy);
+                used_h += ns.cy + (m>i?spacing:0);
+                line_w = max(line_w, ns.cx);
+            }
+            y += ch + spacing;
+            i = j-1;
+            continue;
+        }
+
+        Size ns = Natural(i, opt);
+        int needh = NaturalH(i);
+        if(opt.wrap && y != vr.top && (y + needh > vr.bottom+1)) {
+            int free_px = (vr.bottom - vr.top) - (used_h ? (used_h - spacing) : 0);
+            CommitCol(col_start, i, max(0, free_px));
+            x += line_w + spacing;
+            y = vr.top;
+            col_start = i;
+            used_h = 0;
+            line_w = 0;
+            if(Matches(col_start)) { stopped = true; break; }
+        }
+        item_rect[i] = RectC(0,0, ns.cx, needh);
+        used_h += needh + (i>col_start?spacing:0);
+        line_w = max(line_w, ns.cx);
+        y += needh + spacing;
+    }
+
+    if(stopped) {
+        for(int l = o; l < old.GetCount(); ++l)
+            out.Add(old[l]);
+        run.stop = col_start;
+    }
+    else
+    if(col_start < to) {
+        int free_px = vr.GetHeight() - (used_h ? (used_h - spacing) : 0);
+        CommitCol(col_start, to, max(0, free_px));
+    }
+    run.pos = x;
+}
+
+//==============================================================================
+// Height-for-width probe
+//==============================================================================
+
+/**
+ * Compute natural total height for a given total width (including padding).
+ * Results are cached per model generation and options, each with the range of
+ * inner widths over which its line breaks hold, so repeated GetMinSize() calls
+ * during a parent's layout rescan the items at most once per break pattern.
+ * This method is a *probe*: it does not change item rects or line tables.
+ */
+int FlowGridEngine::MeasureHeightForWidth(int total_width, const Options& o) const {
+    if(total_width <= 0)
+        return 0;
+
+    const int inner_w = max(0, total_width - 2*o.padding);
+    if(probe_gen != model_gen || probe_opt != o) {
+        for(Probe& p : probe)
+            p = Probe();
+        probe_gen = model_gen;
+        probe_opt = o;
+    }
+    for(const Probe& p : probe)
+        if(inner_w >= p.lo && inner_w <= p.hi) {
+            ++counters.probe_hits;
+            return p.height;
+        }
+
+    ++counters.probe_misses;
+    Probe& p = probe[probe_next];
+    probe_next = (probe_next + 1) % __countof(probe);
+    p.height = ProbeHeight(inner_w, o, p.lo, p.hi);
+    return p.height;
+}
+
+/**
+ * Uncached probe for an inner width; [lo, hi] receives the inner widths that
+ * give the same result (empty when it depends on the last layout).
+ * - Flow LTR: simulate wrapping using natural sizes and spacing/padding.
+ * - Flow TTB: width has little effect; returns content height for current data.
+ * - Grid: independent of width; returns measured grid height for current items.
+ */
+int FlowGridEngine::ProbeHeight(int inner_w, const Options& o, int& lo, int& hi) const {
+    const int spacing = o.spacing;
+    lo = 0;
+    hi = INT_MAX;
+
+    // Unified tiles: line count by division (same wrap rule as the simulation below)
+    if(IsUniform(o) && (o.horz || !o.virt)) {
+        const int n = o.virt ? vcount : GetCount();
+        const Size cell = o.unified_sz;
+        if(!o.horz)
+            return (n ? n * cell.cy + (n - 1) * spacing : 0) + 2*o.padding;
+        lo = hi = inner_w;
+        int pl = PerLine(cell.cx, inner_w, spacing, o.wrap, n);
+        int l  = (n + pl - 1) / pl;
+        if(!o.virt && cell.cy <= 0)
+            return 2*o.padding; // flat lines add no spacing either
+        return (l ? l * cell.cy + (l - 1) * spacing : 0) + 2*o.padding;
+    }
+
+    // Virtual grid: track heights do not depend on the width
+    if(o.virt && o.vgrid)
+        return vtrack_rows.Extent(o.spacing) + 2*o.padding;
+
+    // Virtual tiles: rebuild a scratch line table for this width
+    if(o.virt) {
+        if(!o.horz) {
+            lo = 1;
+            hi = 0;
+            return content.cy;
+        }
+        lo = hi = inner_w;
+        Vector<Line> lines;
+        BuildVirtualLines(o, inner_w, 0, lines);
+        int h = lines.GetCount() ? lines.Top().pos + lines.Top().extent : 0;
+        return h + 2*o.padding;
+    }
+
+    // Grid: height is just the grid measurement, independent of width
+    if(o.grid) {
+        GridTracks t;
+        BuildGridTracks(t, Point(0, 0), o);
+        return t.Height() + 2*o.padding;
+    }
+
+    // Flow TopToBottom: width does not affect vertical packing much; approximate
+    if(!o.horz) {
+        // Stack vertically until height sum (with spacing) – ignore column wraps
+        int hsum = 0, count = 0;
+        for(int i = 0; i < GetCount(); ++i) {
+            Kind k = GetKind(i);
+            if(k==Kind::GridCell || k==Kind::BlankGrid || k==Kind::Break) continue;
+            if(k==Kind::Expander) continue; // expanders need container height
+            if(k==Kind::Spacer || k==Kind::Gap) { hsum += MinPx(i); if(count) hsum += spacing; ++count; continue; }
+            Size ns = Natural(i, o);
+            if(count) hsum += spacing;
+            hsum += ns.cy;
+            ++count;
+        }
+        return hsum + 2*o.padding;
+    }
+
+    // Flow LeftToRight: simulate rows. Every width test narrows [lo, hi] to
+    // the widths that would decide it the same way.
+    int x = 0, y = 0, line_h = 0;
+    auto Wraps = [&](int reach) -> bool {
+        if(reach > inner_w) {
+            hi = min(hi, reach - 1);
+            return true;
+        }
+        lo = max(lo, reach);
+        return false;
+    };
+    auto Below = [&](int px) -> bool {
+        if(px < inner_w) {
+            lo = max(lo, px + 1);
+            return true;
+        }
+        hi = min(hi, px);
+        return false;
+    };
+    auto NaturalW = [&](int i)->int {
+        Kind k = GetKind(i);
+        if(k==Kind::Spacer)   return MinPx(i);
+        if(k==Kind::Gap)      return MinPx(i);
+        if(k==Kind::Expander) return 0;
+        return Natural(i, o).cx;
+    };
+
+    auto Newline = [&](){
+        y += line_h;
+        if(y > 0) y += spacing;
+        x = 0;
+        line_h = 0;
+    };
+
+    for(int i=0;i<GetCount();++i) {
+        Kind k = GetKind(i);
+        if(k==Kind::GridCell || k==Kind::BlankGrid) continue;
+
+        if(k == Kind::Break) {
+            if(x > 0 || line_h > 0) Newline();
+            continue;
+        }
+
+        // Atomic cluster
+        int cid = item_cluster[i];
+        if(cid >= 0 && !clusters[cid].flow) {
+            int j=i, cw=0, ch=0; bool first=false;
+            while(j<GetCount() && item_cluster[j]==cid && IsFlowRenderable(GetKind(j))) {
+                if(first) cw += spacing;
+                first = true;
+                cw += NaturalW(j);
+                ch = max(ch, Natural(j, o).cy);
+                j++;
+            }
+            if(o.wrap && x>0 && Wraps(x + cw)) Newline();
+            x += cw;
+            line_h = max(line_h, ch);
+            i = j-1;
+            if(Below(x)) x += spacing;
+            continue;
+        }
+
+        const int wneed = NaturalW(i);
+        const int hneed = (k==Kind::Spacer || k==Kind::Gap) ? 0 : Natural(i, o).cy;
+
+        if(o.wrap && x>0 && Wraps(x + wneed)) Newline();
+        x += wneed;
+        line_h = max(line_h, hneed);
+        if(Below(x)) x += spacing;
+    }
+    if(line_h > 0) y += line_h;
+    return y + 2*o.padding;
+}
+
+} // namespace Upp
@@ -0,0 +1,419 @@
+#ifndef _FlowGridEngine_FlowGridEngine_h_
+#define _FlowGridEngine_FlowGridEngine_h_
+
+#include <Core/Core.h>
+#include <limits.h>
+
+namespace Upp {
+
+//==============================================================================
+// FlowGridEngine: Ctrl-free layout core behind FlowGridLayout.
+// - Input: item descriptors (kind, cluster, natural size, spacer/expander
+//   parameters, grid row/col), cluster flow flags, a view rect and Options.
+// - Output: per-item cell and placement rects, the line table, grid tracks,
+//   cluster bounds and content size (all in content coordinates).
+// - Pure data, no GUI: can run on worker threads and be benchmarked headless.
+//==============================================================================
+
+class FlowGridEngine {
+public:
+    enum class Kind : byte { CtrlItem, Spacer, Expander, Gap, GridCell, BlankGrid, Break };
+
+    /// Cross-axis alignment (same values as FlowGridLayout::Align).
+    enum Align : byte { Auto, Stretch, Start, Center, End };
+
+    /// Layout configuration; a change of any field forces a full pass.
+    struct Options {
+        bool  grid       = false;       ///< Grid vs Flow.
+        bool  horz       = true;        ///< Flow direction H (rows) vs V (columns).
+        bool  wrap       = true;
+        bool  virt       = false;       ///< Lay out vcount virtual tiles instead of items.
+        bool  vgrid      = false;       ///< With virt: tiles form a vrows x vcols grid.
+        bool  unified    = false;       ///< Every item uses unified_sz.
+        Size  unified_sz = Size(0,0);
+        int   spacing    = 0;
+        int   padding    = 0;
+        int   hairline   = 1;           ///< Cross size of spacers/gaps (DPI(1)).
+        Align align      = Stretch;
+
+        bool operator==(const Options& b) const;
+        bool operator!=(const Options& b) const { return !(*this == b); }
+    };
+
+    /// Item descriptor for Add()/Get(); storage itself is split by field.
+    struct Item : Moveable<Item> {
+        Kind  kind = Kind::CtrlItem;
+        int   cluster = -1;         // cluster id (keep-together unit)
+        Size  size = Size(0,0);     // natural size of CtrlItem/GridCell (caller measured)
+        bool  scale_to_cell = false;
+        int   min_px = 0;           // spacer/gap min
+        int   max_px = INT_MAX;     // spacer max
+        int   weight = 0;           // expander weight
+        int   row = -1, col = -1;   // grid addressing
+    };
+
+    // One laid-out line (row in Direction::H, column in Direction::V).
+    struct Line : Moveable<Line> {
+        int start = 0, end = 0;     // item range [start, end)
+        int pos = 0, extent = 0;    // cross-axis offset and thickness
+    };
+
+    // Grid tracks of one axis. Only occupied tracks are stored: a run of empty
+    // tracks takes no entries but still adds one gap per track, so offsets are
+    // those of a dense table while cost and memory follow the occupied count.
+    struct TrackAxis {
+        Vector<int> index;          // occupied track numbers, ascending
+        Vector<int> size;           // natural size of each occupied track
+        Vector<int> sum;            // sizes of the occupied tracks before each slot (+ total)
+        int count = 0;              // dense track count (highest track number + 1)
+        int start = 0, gap = 0;
+
+        int Slot(int track) const;          // slot of an occupied track, or -1
+        int SlotOffset(int k) const         { return start + sum[k] + index[k] * gap; }
+        int Offset(int track) const;        // leading edge of any track; Offset(count) is the far edge
+        int Size(int track) const           { int k = Slot(track); return k >= 0 ? size[k] : 0; }
+        int At(int pos) const;              // track holding pos, or -1 (outside or in a gap)
+        int FirstSlotAfter(int pos) const;  // first slot whose trailing edge passes pos
+        int Extent() const                  { return Offset(count) - start; }
+    };
+    struct GridTracks {
+        TrackAxis col, row;
+        int Width() const           { return col.Extent(); }
+        int Height() const          { return row.Extent(); }
+    };
+
+    struct Cluster : Moveable<Cluster> {
+        bool flow = false;          // allow wrapping inside cluster
+        Rect bounds;                // out: union of child cell rects
+        int  first = INT_MAX;       // out: item span seen by the last flow passes
+        int  last  = -1;
+    };
+
+    static inline bool IsBreak   (Kind k) { return k == Kind::Break; }
+    static inline bool IsCtrl    (Kind k) { return k == Kind::CtrlItem || k == Kind::GridCell; }
+    static inline bool IsGridLike(Kind k) { return k == Kind::GridCell || k == Kind::BlankGrid; }
+    static inline bool IsFlowRenderable(Kind k) { return !(IsGridLike(k) || IsBreak(k)); }
+
+    FlowGridEngine() {}
+    /** Model-only deep copy (items, clusters, virtual tiles) for an off-thread
+        pass; results are left empty, so the copy's first Layout is full. */
+    FlowGridEngine(const FlowGridEngine& src, int);
+
+    //-------------------------------------------------------------------------
+    // Model (input)
+    //-------------------------------------------------------------------------
+
+    Vector<Cluster>     clusters;
+    int                 vcount = 0;     // virtual tile count (Options::virt)
+    Function<Size(int)> vsize;          // virtual tile natural size
+
+    // Virtual grid (Options::vgrid): tile index = row * vcols + col, vcount = vrows * vcols.
+    // Track sizes may be estimates; correct them with SetVirtualTrackSize().
+    int                 vrows = 0, vcols = 0;
+    Function<int(int)>  vrow_size;      // row height
+    Function<int(int)>  vcol_size;      // column width
+
+    // Cumulative instrumentation; snapshots start from zero
+    struct Counters {
+        int64 probe_hits = 0;           // height-for-width probes answered from the cache
+        int64 probe_misses = 0;         // probes that had to scan the items
+    };
+    mutable Counters counters;
+
+    /** Append an item; returns its index. */
+    int  Add(const Item& it);
+    /** Append `count` items with a single reservation; returns the first index. */
+    int  Add(const Item *it, int count);
+    /** Insert an item before index i (i == GetCount() appends). */
+    void Insert(int i, const Item& it);
+    /** Remove the items at the given ascending indices in one sweep. */
+    void Remove(const Vector<int>& sorted);
+    /** Move item `from` so that it ends up at index `to`. */
+    void Move(int from, int to);
+    /** Remove every item; clusters are kept. */
+    void Clear();
+    /** Reserve storage for `n` items. */
+    void Reserve(int n);
+    /** Descriptor of item i (reassembled from the split storage). */
+    Item Get(int i) const;
+    int  GetCount() const                         { return item_kind.GetCount(); }
+    Kind GetKind(int i) const                     { return Kind(item_kind[i] & KIND_MASK); }
+    int  GetCluster(int i) const                  { return item_cluster[i]; }
+    /** Natural size slot of a CtrlItem/GridCell (filled by the caller's measure phase). */
+    Size GetSize(int i) const                     { return item_size[i]; }
+    void SetSize(int i, Size sz)                  { if(item_size[i] != sz) { item_size[i] = sz; ++model_gen; } }
+
+    /** Grow the cluster table so `id` is valid; returns id or -1 for "none". */
+    int  EnsureCluster(int id);
+    /** Mark items [lo, hi] changed; the next Layout resumes from lo. Edits made
+        through the public fields (clusters, vcount, vsize) must call this. */
+    void Invalidate(int lo = 0, int hi = INT_MAX) { dirty_lo = min(dirty_lo, lo); dirty_hi = max(dirty_hi, hi); ++model_gen; }
+    /** Lowest dirty item (INT_MAX when clean). */
+    int  GetDirtyFrom() const                     { return dirty_lo; }
+    /** Forget the dirty range (its changes were handed to a copy). */
+    void ClearDirty()                             { dirty_lo = INT_MAX; dirty_hi = -1; }
+    /** Evaluate vsize for every tile now and drop the callback, so the model no
+        longer calls back into its owner (required before an off-thread pass). */
+    void FreezeVirtualSizes();
+    /** Return to calling vsize. */
+    void ThawVirtualSizes()                       { vfrozen.Clear(); }
+    /** Re-query every virtual grid track size on the next Layout (counts are
+        checked automatically). */
+    void InvalidateVirtualGrid()                  { vtracks_stale = true; ++model_gen; }
+    /** Replace one virtual grid row height / column width; O(log n). */
+    void SetVirtualTrackSize(bool row, int i, int size);
+
+    //-------------------------------------------------------------------------
+    // Passes
+    //-------------------------------------------------------------------------
+
+    /** Lay out into `view` (padding is applied inside). Full pass when the view,
+        the options or item 0 changed; otherwise resumes from the first dirty line. */
+    void Layout(const Rect& view, const Options& o);
+    /** Height-for-width probe (includes padding); does not touch results.
+        Cached by width interval until the model or the options change. */
+    int  MeasureHeightForWidth(int total_width, const Options& o) const;
+    /** Conservative natural size; `width` is used by the Flow H + wrap probe. */
+    Size GetMinSize(int width, const Options& o) const;
+    /** Natural size of item i under the given options. */
+    Size Natural(int i, const Options& o) const;
+
+    //-------------------------------------------------------------------------
+    // Results (content coordinates; valid after Layout)
+    //-------------------------------------------------------------------------
+
+    Size                GetContentSize() const      { return content; }
+    const Options&      GetOptions() const          { return opt; }
+    const Vector<Line>& GetLines() const            { return opt.virt ? vlines : lines; }
+    const GridTracks&   GetGrid() const             { return grid; }
+    /** Item range [lo, hi) whose rects were recomputed by the last Layout. */
+    int                 GetDoneLo() const           { return done_lo; }
+    int                 GetDoneHi() const           { return done_hi; }
+    /** True when the last Layout used the closed form for unified tiles: no line
+        table or stored rects, every query is computed from the index. */
+    bool                IsUniform() const           { return uniform; }
+    /** Whether a layout with these options would take the closed form. */
+    bool                IsUniform(const Options& o) const;
+
+    /** Item (or virtual tile) at a content point, or -1. O(log n). */
+    int  ItemAt(Point p) const;
+    /** Items (or virtual tiles) intersecting a content rect, in layout order. */
+    void ItemsIn(const Rect& q, Vector<int>& out) const;
+    /** Cell rect of an item or virtual tile (empty if out of range). */
+    Rect GetItemRect(int i) const;
+    /** Control rect of a CtrlItem/GridCell inside its cell (empty if not laid out). */
+    Rect GetPlace(int i) const;
+    /** Column/row containing a content coordinate, or -1 (outside or in a gap). */
+    int  FindColumn(int x) const                    { return grid.col.At(x); }
+    int  FindRow(int y) const                       { return grid.row.At(y); }
+
+    /** Call fn(index, cell) for each virtual tile intersecting `q`. */
+    template <class F> void VisitVirtual(const Rect& q, F fn) const;
+    /** Call fn(index, cell) for each unified tile intersecting `q` (IsUniform() only). */
+    template <class F> void VisitUniform(const Rect& q, F fn) const;
+    /** Call fn(index, cell) for each virtual grid cell intersecting `q`, row by row. */
+    template <class F> void VisitVirtualGrid(const Rect& q, F fn) const;
+
+    /** Index of the first line whose far edge lies beyond `pos` (lines sorted by pos). */
+    static int FirstLineAfter(const Vector<Line>& lines, int pos);
+
+private:
+    // Item storage, one array per field (index = item index). The line breaker
+    // streams only kind/cluster/size; the per-kind parameters share one slot.
+    enum { KIND_MASK = 0x0f, SCALE_TO_CELL = 0x80 };
+    Vector<byte>    item_kind;      // Kind | SCALE_TO_CELL
+    Vector<int>     item_cluster;
+    Vector<Size>    item_size;      // natural size (CtrlItem/GridCell)
+    Vector<Point>   item_param;     // Spacer/Gap: (min_px, max_px), Expander: (weight, 0), grid: (col, row)
+    Vector<Rect>    item_rect;      // out: cell area
+    int             irregular = 0;  // items other than plain CtrlItems outside clusters
+
+    int  MinPx(int i) const                     { return item_param[i].x; }
+    int  MaxPx(int i) const                     { return item_param[i].y; }
+    int  Weight(int i) const                    { return item_param[i].x; }
+    int  Col(int i) const                       { return item_param[i].x; }
+    int  Row(int i) const                       { return item_param[i].y; }
+
+    static byte  PackKind(const Item& it);
+    static Point PackParam(const Item& it);
+
+    Vector<Size>    vfrozen;        // tile sizes captured by FreezeVirtualSizes
+
+    // Virtual grid tracks: sizes in a Fenwick tree, so the offset of a track, the
+    // track at an offset and a size correction are all O(log n). Gaps are not
+    // stored; track i adds i * gap.
+    struct FenwickTracks {
+        Vector<int> size;
+        Vector<int> tree;           // 1-based partial sums of size
+
+        FenwickTracks() {}
+        FenwickTracks(const FenwickTracks& s, int) : size(s.size, 0), tree(s.tree, 0) {}
+
+        int  GetCount() const       { return size.GetCount(); }
+        void Build(int n, const Function<int(int)>& fn, int keep);
+        void Set(int i, int sz);
+        int  Offset(int i, int gap) const;          // leading edge of track i (i == count: past the last gap)
+        int  Extent(int gap) const                  { return GetCount() ? Offset(GetCount(), gap) - gap : 0; }
+        int  Find(int pos, int gap) const;          // last track starting at or before pos, -1 if none
+        int  FirstAfter(int pos, int gap) const;    // first track whose trailing edge passes pos
+    };
+    FenwickTracks   vtrack_rows, vtrack_cols;
+    bool            vtracks_stale = true;
+
+    Options         opt;
+    Rect            inner;          // view minus padding, from the last Layout
+
+    Vector<Line>    lines;          // flow line table, sorted by pos
+    Vector<Line>    vlines;         // virtual line table
+    GridTracks      grid;
+    Vector<int>     grid_cells;     // GridCell items sorted by (row, col)
+    Size            content = Size(0,0);
+
+    // Closed form (unified tiles): tile i sits in line i / per_line, slot i % per_line
+    bool            uniform = false;
+    int             per_line = 1;
+    int             uniform_count = 0;
+
+    // Height-for-width cache: a few break patterns, each valid for an inner-width range
+    struct Probe {
+        int lo = 1, hi = 0;         // inner widths giving `height` (empty: unused)
+        int height = 0;
+    };
+    int             model_gen = 0;          // bumped by every model edit
+    mutable Probe   probe[4];
+    mutable int     probe_next = 0;
+    mutable int     probe_gen = -1;
+    mutable Options probe_opt;
+
+    // Incremental relayout
+    int             dirty_lo = 0;       // lowest item needing relayout (INT_MAX: clean)
+    int             dirty_hi = INT_MAX; // highest such item
+    int             done_lo = 0, done_hi = 0;
+    Index<int>      stale_clusters;     // clusters that lost items since the last pass
+
+    // One run of the line breaker: all items, the tail of an incremental pass,
+    // or one Break-separated segment of a parallel pass
+    struct FlowRun {
+        int           from = 0, to = 0; // items; `to` is GetCount() or just past a Break
+        int           pos = 0;          // cross offset of the first line; of the next on return
+        bool          full = true;
+        bool          note = true;      // record cluster cells (off on worker threads)
+        Vector<Line> *out = nullptr;    // committed lines are appended here
+        Vector<Line>  old;              // previous lines from the restart point on
+        Index<int>    touched;          // clusters to rebuild after an incremental run
+        int           stop = -1;        // first item left as-is after an early stop
+    };
+    enum { PARALLEL_MIN_ITEMS = 4096 }; // smaller full passes stay on one thread
+
+    // Flow passes (full, or resumed from the first dirty line)
+    void LayoutFlow(bool full);
+    bool LayoutSegments();
+    void LayoutHorizontal(FlowRun& run);
+    void LayoutVertical(FlowRun& run);
+    void LayoutGrid();
+    void LayoutVirtual();
+    int  ResumeLine() const;
+    void ResetClusters();
+    void NoteClusterCell(int id, int i, const Rect& cell, bool full, Index<int>& touched);
+    void RecomputeClusterBounds(int id);
+    Size FlowContentSize() const;
+    Rect PlaceInCell(int i, const Rect& cell) const;
+
+    // Closed form
+    void LayoutUniform();
+    Rect UniformCell(int line, int slot) const;
+    int  UniformItemAt(Point p) const;
+    static int PerLine(int len, int limit, int gap, bool wrap, int count);
+    static int FirstSlotAfter(int pos, int len, int step);
+
+    // Height-for-width
+    int  ProbeHeight(int inner_w, const Options& o, int& lo, int& hi) const;
+
+    // Virtual tiles
+    void LayoutVirtualGrid();
+    void SyncVirtualTracks();
+    Size VirtualSize(int i, const Options& o) const;
+    int  BuildVirtualLines(const Options& o, int limit, int cross0, Vector<Line>& out) const;
+
+    // Grid tracks
+    void BuildGridTracks(GridTracks& t, Point start, const Options& o) const;
+    void BuildTrackAxis(TrackAxis& t, bool rows, int start, const Options& o) const;
+    int         LowerGridCell(int row, int col) const;
+
+    // Queries
+    int  LineItemAfter(const Line& ln, int pos) const;
+};
+
+template <class F>
+void FlowGridEngine::VisitVirtual(const Rect& q, F fn) const {
+    if(uniform) {
+        VisitUniform(q, fn);
+        return;
+    }
+    if(opt.vgrid) {
+        VisitVirtualGrid(q, fn);
+        return;
+    }
+    const bool horz = opt.horz;
+    const int  qlo  = horz ? q.top  : q.left, qhi = horz ? q.bottom : q.right;
+    const int  mlo  = horz ? q.left : q.top,  mhi = horz ? q.right  : q.bottom;
+
+    for(int l = FirstLineAfter(vlines, qlo); l < vlines.GetCount(); ++l) {
+        const Line& ln = vlines[l];
+        if(ln.pos >= qhi)
+            break;
+        int m = horz ? inner.left : inner.top;
+        for(int i = ln.start; i < ln.end && m < mhi; ++i) {
+            Size sz  = VirtualSize(i, opt);
+            int  len = horz ? sz.cx : sz.cy;
+            if(m + len > mlo)
+                fn(i, horz ? RectC(m, ln.pos, len, ln.extent) : RectC(ln.pos, m, ln.extent, len));
+            m += len + opt.spacing;
+        }
+    }
+}
+
+template <class F>
+void FlowGridEngine::VisitVirtualGrid(const Rect& q, F fn) const {
+    const FenwickTracks& rows = vtrack_rows;
+    const FenwickTracks& cols = vtrack_cols;
+    const int  gap = opt.spacing;
+    const Rect r   = q.Offseted(-inner.TopLeft());
+    const int  c0  = cols.FirstAfter(r.left, gap);
+    const int  x0  = cols.Offset(c0, gap);
+    const int  r0  = rows.FirstAfter(r.top, gap);
+    int y = rows.Offset(r0, gap);
+    for(int row = r0; row < rows.GetCount() && y < r.bottom; ++row) {
+        int x = x0;
+        for(int col = c0; col < cols.GetCount() && x < r.right; ++col) {
+            fn(row * cols.GetCount() + col, RectC(inner.left + x, inner.top + y, cols.size[col], rows.size[row]));
+            x += cols.size[col] + gap;
+        }
+        y += rows.size[row] + gap;
+    }
+}
+
+template <class F>
+void FlowGridEngine::VisitUniform(const Rect& q, F fn) const {
+    const bool horz = opt.horz;
+    const Size cell = opt.unified_sz;
+    const int  len  = horz ? cell.cx : cell.cy, ext = horz ? cell.cy : cell.cx;
+    if(len <= 0 || ext <= 0)
+        return; // empty cells intersect nothing
+    const Rect r    = q.Offseted(-inner.TopLeft());
+    const int  qlo  = horz ? r.top  : r.left, qhi = horz ? r.bottom : r.right;
+    const int  mlo  = horz ? r.left : r.top,  mhi = horz ? r.right  : r.bottom;
+    const int  line_count = (uniform_count + per_line - 1) / per_line;
+
+    for(int l = FirstSlotAfter(qlo, ext, ext + opt.spacing); l < line_count && l * (ext + opt.spacing) < qhi; ++l)
+        for(int k = FirstSlotAfter(mlo, len, len + opt.spacing); k < per_line && k * (len + opt.spacing) < mhi; ++k) {
+            int i = l * per_line + k;
+            if(i >= uniform_count)
+                break;
+            fn(i, UniformCell(l, k));
+        }
+}
+
+} // namespace Upp
+
+#endif // _FlowGridEngine_FlowGridEngine_h_
@@ -2,6 +2,18 @@
 
 namespace Upp {
 
+namespace {
+
+/** Adds the scope's elapsed microseconds to `acc`; no clock reads when off. */
+struct StatTimer {
+    int64 *acc;
+    int64  t0;
+    StatTimer(bool on, int64& a) : acc(on ? &a : nullptr), t0(on ? usecs() : 0) {}
+    ~StatTimer()                 { if(acc) *acc += usecs() - t0; }
+};
+
+}
+
 //==============================================================================
 // Construction / public surface
 //==============================================================================
@@ -11,31 +23,40 @@ FlowGridLayout::FlowGridLayout() {
     Transparent(false);
     AddFrame(sb);
     sb.WhenScroll << [=]{
-        // Avoid re-entrancy while frames are recalculating.
-        PostCallback([=]{ ApplyScrollbars(); });
+        // Thumb moves join the frame-coalesced scroll path; deferring also
+        // avoids re-entrancy while frames are recalculating.
+        scroll_target = sb.Get();
+        scroll_glide  = false;
+        RequestScrollFrame();
     };
     sb.WhenLeftClick << [=]{ SetFocus(); };
 }
 
+/** Destructor: a worker may still hold a snapshot and post its result. */
+FlowGridLayout::~FlowGridLayout() {
+    async_work.Finish();
+    KillTimeCallback(TIMEID_ASYNC);
+    KillTimeCallback(TIMEID_SCROLL);
+    KillTimeCallback(TIMEID_REFLOW);
+}
+
 /** Create and return a new cluster id. */
 int FlowGridLayout::NewCluster() {
-    int id = clusters.GetCount();
-    clusters.Add(Cluster());
-    return id;
+    return EnsureCluster(clusters.GetCount());
 }
 
-/** Ensure cluster index exists; return normalized id or -1 for "none". */
+/** Ensure cluster index exists (here and in the engine); return id or -1 for "none". */
 int FlowGridLayout::EnsureCluster(int id) {
     if(id < 0) return -1;
     while(id >= clusters.GetCount())
         clusters.Add(Cluster());
-    return id;
+    return engine.EnsureCluster(id);
 }
 
 /** Allow or forbid wrapping inside a specific cluster. */
 FlowGridLayout& FlowGridLayout::SetClusterFlow(int id, bool on) {
     id = EnsureCluster(id);
-    if(id >= 0) { clusters[id].flow = on; Reflow(); }
+    if(id >= 0) { engine.clusters[id].flow = on; Reflow(); }
     return *this;
 }
 
@@ -58,92 +79,402 @@ FlowGridLayout& FlowGridLayout::SetClusterHeader(int id, bool on, bool with_box)
     return *this;
 }
 
+/** Append an item to both the adapter and the engine model; returns its index. */
+int FlowGridLayout::AddItem(Kind kind, int cluster_id, FlowGridEngine::Item it) {
+    Item& m = items.Add();
+    m.handle = next_handle++;
+    handle_pos.Add(items.GetCount() - 1);
+    it.kind    = kind;
+    it.cluster = EnsureCluster(cluster_id);
+    return engine.Add(it);
+}
+
 /** Add a control to the flow, optionally bound to a cluster. */
 int FlowGridLayout::Add(Ctrl& c, int cluster_id, bool scale_to_cell, Size fixed) {
-    Item& it = items.Add();
-    it.kind         = Kind::CtrlItem;
-    it.ctrl         = &c;
-    it.cluster      = EnsureCluster(cluster_id);
-    it.scale_to_cell= scale_to_cell;
-    it.fixed        = fixed;
+    FlowGridEngine::Item it;
+    it.scale_to_cell = scale_to_cell;
+    int i = AddItem(Kind::CtrlItem, cluster_id, it);
+    items[i].ctrl  = &c;
+    items[i].fixed = fixed;
 
     // Add as child control via base class to avoid our overload.
     Ctrl::Add(c);
 
-    Reflow();
-    return items.GetCount() - 1;
+    Reflow(i, i);
+    return items[i].handle;
+}
+
+/** Bulk Add(): one reservation per array, the engine's bulk Add(), one attach
+    pass and one reflow. */
+int FlowGridLayout::AddRange(const ItemSpec *spec, int count) {
+    int first = next_handle;
+    if(count <= 0)
+        return first;
+    int lo = items.GetCount();
+    items.Reserve(lo + count);
+    handle_pos.Reserve(next_handle + count);
+
+    Vector<FlowGridEngine::Item> model;
+    model.SetCount(count);
+    for(int k = 0; k < count; ++k) {
+        const ItemSpec& s = spec[k];
+        Item& m  = items.Add();
+        m.ctrl   = s.ctrl;
+        m.fixed  = s.fixed;
+        m.handle = next_handle++;
+        handle_pos.Add(lo + k);
+        FlowGridEngine::Item& it = model[k];
+        it.cluster       = EnsureCluster(s.cluster_id);
+        it.scale_to_cell = s.scale_to_cell;
+    }
+    engine.Add(model.begin(), count);
+    for(int k = 0; k < count; ++k)
+        if(spec[k].ctrl)
+            Ctrl::Add(*spec[k].ctrl);
+
+    Reflow(lo, lo + count - 1);
+    return first;
 }
 
 /** Add a spacer with min/max pixels along the main axis. */
 int FlowGridLayout::AddSpacer(int min_px, int max_px, int cluster_id) {
-    Item& it = items.Add();
-    it.kind = Kind::Spacer;
-    it.cluster = EnsureCluster(cluster_id);
+    FlowGridEngine::Item it;
     it.min_px = min_px;
     it.max_px = max_px;
-    Reflow();
-    return items.GetCount()-1;
+    int i = AddItem(Kind::Spacer, cluster_id, it);
+    Reflow(i, i);
+    return items[i].handle;
 }
 
 /** Add an expanding gap (weight shares leftover main-axis space). */
 int FlowGridLayout::AddExpand(int weight, int cluster_id) {
-    Item& it = items.Add();
-    it.kind = Kind::Expander;
-    it.cluster = EnsureCluster(cluster_id);
+    FlowGridEngine::Item it;
     it.weight = max(1, weight);
-    Reflow();
-    return items.GetCount()-1;
+    int i = AddItem(Kind::Expander, cluster_id, it);
+    Reflow(i, i);
+    return items[i].handle;
 }
 
 /** Add a fixed-pixel gap along the main axis. */
 int FlowGridLayout::AddGap(int px, int cluster_id) {
-    Item& it = items.Add();
-    it.kind = Kind::Gap;
-    it.cluster = EnsureCluster(cluster_id);
+    FlowGridEngine::Item it;
     it.min_px = it.max_px = max(0, px);
-    Reflow();
-    return items.GetCount()-1;
+    int i = AddItem(Kind::Gap, cluster_id, it);
+    Reflow(i, i);
+    return items[i].handle;
 }
 
 /** Insert a hard line/column break (Flow mode). */
 int FlowGridLayout::AddBreak(int cluster_id) {
-    Item& it = items.Add();
-    it.kind    = Kind::Break;
-    it.cluster = EnsureCluster(cluster_id);
-    Reflow();
-    return items.GetCount() - 1;
+    int i = AddItem(Kind::Break, cluster_id, FlowGridEngine::Item());
+    Reflow(i, i);
+    return items[i].handle;
 }
 
 /** Add a control to the grid at (row, col). */
 int FlowGridLayout::AddGrid(Ctrl& c, int row, int col, bool scale_to_cell, Size fixed) {
-    Item& it = items.Add();
-    it.kind         = Kind::GridCell;
-    it.ctrl         = &c;
-    it.row          = row;
-    it.col          = col;
-    it.scale_to_cell= scale_to_cell;
-    it.fixed        = fixed;
+    FlowGridEngine::Item it;
+    it.row           = row;
+    it.col           = col;
+    it.scale_to_cell = scale_to_cell;
+    int i = AddItem(Kind::GridCell, -1, it);
+    items[i].ctrl  = &c;
+    items[i].fixed = fixed;
 
     Ctrl::Add(c);
 
-    Reflow();
-    return items.GetCount() - 1;
+    Reflow(i, i);
+    return items[i].handle;
 }
 
 /** Reserve a blank grid cell (affects row/col measurement). */
 int FlowGridLayout::AddBlankGrid(int row, int col) {
-    Item& it = items.Add();
-    it.kind = Kind::BlankGrid;
+    FlowGridEngine::Item it;
     it.row = row;
     it.col = col;
+    int i = AddItem(Kind::BlankGrid, -1, it);
+    Reflow(i, i);
+    return items[i].handle;
+}
+
+//==============================================================================
+// Editing (stable handles)
+//==============================================================================
+
+/** Current index of a handle, or -1 once removed. */
+int FlowGridLayout::GetIndex(int handle) const {
+    return handle >= 0 && handle < handle_pos.GetCount() ? handle_pos[handle] : -1;
+}
+
+/** Re-point the handles of items [lo, hi] after they shifted in `items`. */
+void FlowGridLayout::RenumberHandles(int lo, int hi) {
+    for(int i = lo; i <= hi; ++i)
+        if(items[i].handle >= 0)
+            handle_pos[items[i].handle] = i;
+}
+
+/** Insert a control before the item `before` (-1 appends). Shifts the items
+    after it, so the cost is O(items after `before`). */
+int FlowGridLayout::Insert(int before, Ctrl& c, int cluster_id, bool scale_to_cell, Size fixed) {
+    SweepRemoved();
+    int at = before < 0 ? items.GetCount() : GetIndex(before);
+    if(at < 0)
+        at = items.GetCount();
+
+    FlowGridEngine::Item it;
+    it.kind          = Kind::CtrlItem;
+    it.cluster       = EnsureCluster(cluster_id);
+    it.scale_to_cell = scale_to_cell;
+    engine.Insert(at, it);
+
+    Item& m = items.Insert(at);
+    m.ctrl   = &c;
+    m.fixed  = fixed;
+    m.handle = next_handle++;
+    handle_pos.Add();
+    RenumberHandles(at, items.GetCount() - 1);
+    parked = false; // `placed` holds indices
+
+    Ctrl::Add(c);
+    Reflow(at, at);
+    return m.handle;
+}
+
+/** Detach the item's control and tombstone it; the model is swept in one pass
+    before the next layout, so removing k items costs O(k) here. */
+FlowGridLayout& FlowGridLayout::Remove(int handle) {
+    int i = GetIndex(handle);
+    if(i < 0)
+        return *this;
+    Item& m = items[i];
+    if(m.ctrl)
+        m.ctrl->Remove();
+    m.ctrl   = nullptr;
+    m.handle = -1;
+    handle_pos[handle] = -1;
+    ++removed_count;
+    Reflow(i, i);
+    return *this;
+}
+
+/** Move an item before the item `before` (-1 moves it to the end); O(distance). */
+FlowGridLayout& FlowGridLayout::Move(int handle, int before) {
+    SweepRemoved();
+    int from = GetIndex(handle);
+    int to   = before < 0 ? items.GetCount() : GetIndex(before);
+    if(from < 0 || to < 0)
+        return *this;
+    if(to > from)
+        --to; // index after taking the item out
+    if(to == from)
+        return *this;
+
+    Item m = items[from];
+    items.Remove(from);
+    items.Insert(to, m);
+    engine.Move(from, to);
+    RenumberHandles(min(from, to), max(from, to));
+    parked = false;
+    Reflow(min(from, to), max(from, to));
+    return *this;
+}
+
+/** Remove every item and detach all controls; handles issued before stay invalid. */
+FlowGridLayout& FlowGridLayout::Clear() {
+    for(Item& m : items)
+        if(m.ctrl)
+            m.ctrl->Remove();
+    items.Clear();
+    engine.Clear();
+    handle_pos.Clear();
+    handle_pos.SetCount(next_handle, -1); // numbering continues, old handles map to -1
+    removed_count = 0;
+    anchor_handle = -1;
+    placed.Clear();
+    parked = false;
     Reflow();
-    return items.GetCount()-1;
+    return *this;
+}
+
+/** Drop tombstoned items from the adapter and the engine in one sweep. */
+void FlowGridLayout::SweepRemoved() {
+    if(!removed_count)
+        return;
+    Vector<int> gone;
+    int n = 0;
+    for(int i = 0; i < items.GetCount(); ++i)
+        if(items[i].handle < 0)
+            gone.Add(i);
+        else {
+            handle_pos[items[i].handle] = n;
+            items[n++] = items[i];
+        }
+    items.Trim(n);
+    engine.Remove(gone);
+    removed_count = 0;
+    parked = false;
+}
+
+/** Leading edge of column i from the last layout (clamped to the far edge). */
+int FlowGridLayout::GetColumnOffset(int i) const {
+    const FlowGridEngine::TrackAxis& x = engine.GetGrid().col;
+    return x.Offset(minmax(i, 0, x.count));
+}
+
+/** Leading edge of row i from the last layout (clamped to the far edge). */
+int FlowGridLayout::GetRowOffset(int i) const {
+    const FlowGridEngine::TrackAxis& y = engine.GetGrid().row;
+    return y.Offset(minmax(i, 0, y.count));
+}
+
+//==============================================================================
+// Virtual mode
+//==============================================================================
+
+/** Enter virtual mode with `count` tiles sized by `size_fn`. */
+FlowGridLayout& FlowGridLayout::SetVirtual(int count, Function<Size(int)> size_fn) {
+    UnrealizeAll(); // indices may now refer to different data
+    virtual_mode = true;
+    virtual_grid = false;
+    engine.vcount = max(0, count);
+    engine.vsize = pick(size_fn);
+    Reflow();
+    return *this;
+}
+
+/** Enter virtual grid mode: rows x cols cells sized per track. */
+FlowGridLayout& FlowGridLayout::SetVirtualGrid(int rows, int cols, Function<int(int)> row_height,
+                                               Function<int(int)> col_width) {
+    UnrealizeAll();
+    virtual_mode = virtual_grid = true;
+    engine.vrow_size = pick(row_height);
+    engine.vcol_size = pick(col_width);
+    engine.InvalidateVirtualGrid();
+    return SetVirtualGridSize(rows, cols);
+}
+
+/** Resize the virtual grid; realized cells past the end are dropped on sync. */
+FlowGridLayout& FlowGridLayout::SetVirtualGridSize(int rows, int cols) {
+    if(cols != engine.vcols)
+        UnrealizeAll(); // tile indices depend on the column count
+    engine.vrows  = max(0, rows);
+    engine.vcols  = max(0, cols);
+    engine.vcount = (int)min<int64>((int64)engine.vrows * engine.vcols, INT_MAX);
+    Reflow();
+    return *this;
+}
+
+/** Correct one row height; offsets of the rows below follow in O(log n). */
+FlowGridLayout& FlowGridLayout::SetVirtualRowHeight(int row, int cy) {
+    engine.SetVirtualTrackSize(true, row, cy);
+    Reflow();
+    return *this;
+}
+
+/** Correct one column width. */
+FlowGridLayout& FlowGridLayout::SetVirtualColumnWidth(int col, int cx) {
+    engine.SetVirtualTrackSize(false, col, cx);
+    Reflow();
+    return *this;
+}
+
+/** Change the tile count; realized tiles past the end are dropped on sync. */
+FlowGridLayout& FlowGridLayout::SetVirtualCount(int count) {
+    engine.vcount = max(0, count);
+    Reflow();
+    return *this;
+}
+
+/** Leave virtual mode and release every realized tile. */
+FlowGridLayout& FlowGridLayout::NoVirtual() {
+    UnrealizeAll();
+    virtual_mode = virtual_grid = false;
+    engine.vcount = engine.vrows = engine.vcols = 0;
+    engine.vsize.Clear();
+    engine.vrow_size.Clear();
+    engine.vcol_size.Clear();
+    engine.InvalidateVirtualGrid();
+    Reflow();
+    return *this;
+}
+
+/** Realize tiles entering the view, reposition kept ones, release the rest. */
+void FlowGridLayout::SyncVirtual() {
+    VectorMap<int, Ctrl*> live;
+    if(WhenRealize)
+        engine.VisitVirtual(GetView().Offseted(origin), [&](int i, const Rect& r) {
+            Ctrl *c = nullptr;
+            int q = vrealized.Find(i);
+            if(q >= 0) {
+                c = vrealized[q];
+                vrealized.Unlink(q);
+            }
+            else
+            if((c = WhenRealize(i)) != nullptr)
+                Ctrl::Add(*c);
+            if(c) {
+                c->SetRect(r.Offseted(-origin));
+                ++stats.set_rect;
+                live.Add(i, c);
+            }
+        });
+    UnrealizeAll();
+    vrealized = pick(live);
+}
+
+/** Detach every realized tile Ctrl and notify the owner. */
+void FlowGridLayout::UnrealizeAll() {
+    for(int i = 0; i < vrealized.GetCount(); ++i) {
+        if(vrealized.IsUnlinked(i))
+            continue;
+        Ctrl *c = vrealized[i];
+        c->Remove();
+        if(WhenUnrealize)
+            WhenUnrealize(vrealized.GetKey(i), *c);
+    }
+    vrealized.Clear();
+}
+
+/** Paint visible tiles that are not covered by a realized Ctrl. */
+void FlowGridLayout::PaintVirtual(Draw& w) {
+    if(!WhenPaintItem)
+        return;
+    engine.VisitVirtual(w.GetPaintRect().Offseted(origin), [&](int i, const Rect& r) {
+        if(vrealized.Find(i) < 0)
+            WhenPaintItem(w, r.Offseted(-origin), i);
+    });
+}
+
+/** Tile index under a view point, or -1. */
+int FlowGridLayout::VirtualItemAt(Point p) const {
+    return virtual_mode ? engine.ItemAt(p + origin) : -1;
+}
+
+/** Tile cell in content coordinates; walks only the line holding it. */
+Rect FlowGridLayout::GetVirtualItemRect(int index) const {
+    return virtual_mode ? engine.GetItemRect(index) : Rect(0,0,0,0);
 }
 
 //==============================================================================
 // Layout and scrollbars
 //==============================================================================
 
+/** Engine options mirroring the current configuration and style. */
+FlowGridEngine::Options FlowGridLayout::GetOptions() const {
+    FlowGridEngine::Options o;
+    o.grid       = mode == FGLMode::Grid;
+    o.horz       = dir == Direction::H;
+    o.wrap       = wrap;
+    o.virt       = virtual_mode;
+    o.vgrid      = virtual_grid;
+    o.unified    = unified;
+    o.unified_sz = unified_sz;
+    o.spacing    = style.spacing;
+    o.padding    = style.padding;
+    o.hairline   = DPI(1);
+    o.align      = (FlowGridEngine::Align)align_items;
+    return o;
+}
 
 /**
  * Conservative natural size.
@@ -155,123 +486,67 @@ int FlowGridLayout::AddBlankGrid(int row, int col) {
  * Always includes padding.
  */
 Size FlowGridLayout::GetMinSize() const {
-    // ---------- Grid envelope ----------
-    if(mode == FGLMode::Grid) {
-        // Measure rows/cols as Layout() does (but without touching children).
-        int maxrow = -1, maxcol = -1;
-        for(const Item& it : items)
-            if(it.kind == Kind::GridCell || it.kind == Kind::BlankGrid) {
-                maxrow = max(maxrow, it.row);
-                maxcol = max(maxcol, it.col);
-            }
-
-        const int rows = maxrow + 1;
-        const int cols = max(maxcol + 1, 0);
-
-        Vector<int> colw, rowh;
-        colw.SetCount(cols, 0);
-        rowh.SetCount(max(0, rows), 0);
-
-        for(const Item& it : items)
-            if(it.kind == Kind::GridCell) {
-                Size ns = NaturalItemSize(it);
-                colw[it.col] = max(colw[it.col], ns.cx);
-                rowh[it.row] = max(rowh[it.row], ns.cy);
-            }
-
-        int sumw = 0, sumh = 0;
-        for(int c = 0; c < colw.GetCount(); ++c) {
-            if(c) sumw += style.spacing;
-            sumw += colw[c];
-        }
-        for(int r = 0; r < rowh.GetCount(); ++r) {
-            if(r) sumh += style.spacing;
-            sumh += rowh[r];
-        }
-
-        return Size(sumw + 2*style.padding, sumh + 2*style.padding);
+    // Measuring fills the engine's size slots; mirror FlowBox with const_cast.
+    {
+        StatTimer t(stats_on, stats.measure_us);
+        const_cast<FlowGridLayout*>(this)->MeasureItems();
     }
 
-    // ---------- Flow envelope ----------
-    const int gap = style.spacing;
-
-    auto IsFlowRenderable = [&](const Item& it)->bool {
-        // skip Grid/BlankGrid entirely; Break is not a renderable item
-        return !(it.kind == Kind::GridCell || it.kind == Kind::BlankGrid || it.kind == Kind::Break);
-    };
-
-    auto NaturalW = [&](const Item& it)->int {
-        if(it.kind == Kind::Spacer || it.kind == Kind::Gap)   return it.min_px;
-        if(it.kind == Kind::Expander)                          return 0;
-        return NaturalItemSize(it).cx;
-    };
-    auto NaturalH = [&](const Item& it)->int {
-        if(it.kind == Kind::Spacer || it.kind == Kind::Gap)   return it.min_px;
-        if(it.kind == Kind::Expander)                          return 0;
-        return NaturalItemSize(it).cy;
-    };
-
-    // Flow, Left-to-right, wrapping: height-for-width probe like FlowBox.
-    if(dir == Direction::H && wrap) {
-        int eff_total_w = GetSize().cx;
-        if(eff_total_w <= 0) {
-            // fallback: a conservative width that avoids silly tall estimates
-            eff_total_w = DPI(240);
-        }
-        // MeasureHeightForWidth is non-const; mirror FlowBox with const_cast.
-        int h = const_cast<FlowGridLayout*>(this)->MeasureHeightForWidth(eff_total_w);
-        if(h < 0) h = 0;
-
-        // Width baseline: report current width if any, else the conservative fallback.
-        int baseline_w = GetSize().cx;
-        if(baseline_w <= 0) baseline_w = DPI(240);
-        return Size(baseline_w, h);
-    }
+    // Width baseline: current width if any, else a conservative fallback that
+    // avoids silly tall estimates.
+    int w = GetSize().cx;
+    if(w <= 0)
+        w = DPI(240);
+    return engine.GetMinSize(w, GetOptions());
+}
 
-    // Flow, Top-to-bottom (stack): sum heights (+gaps), width = max width.
-    if(dir == Direction::V) {
-        int sumh = 0, maxw = 0, count = 0;
-        for(const Item& it : items) {
-            if(!IsFlowRenderable(it)) continue;
-            if(count) sumh += gap;
-            sumh += NaturalH(it);
-            maxw = max(maxw, NaturalW(it));
-            ++count;
+/** Measure a control item into the engine's size slot. */
+Size FlowGridLayout::MeasureItem(int i) {
+    Item& it = items[i];
+    Size ms = it.fixed;
+    if(ms.cx <= 0 && ms.cy <= 0) {
+        ms = Size(0,0);
+        if(it.ctrl) {
+            ms = it.ctrl->GetMinSize();
+            ++stats.child_min_size;
         }
-        return Size(maxw + 2*style.padding, sumh + 2*style.padding);
     }
+    engine.SetSize(i, ms);
+    ++stats.measured;
+    it.measured = measure_gen;
+    return ms;
+}
 
-    // Flow, Left-to-right, no wrap: sum widths (+gaps), height = max height.
-    {
-        int sumw = 0, maxh = 0, count = 0;
-        for(const Item& it : items) {
-            if(!IsFlowRenderable(it)) continue;
-            if(count) sumw += gap;
-            sumw += NaturalW(it);
-            maxh = max(maxh, NaturalH(it));
-            ++count;
-        }
-        return Size(sumw + 2*style.padding, maxh + 2*style.padding);
+/** A DPI or standard font change invalidates the natural-size cache, header text extents and the box patch. */
+void FlowGridLayout::SyncMeasureSkin() const {
+    int skin = DPI(1000) ^ (GetStdFontCy() << 16);
+    if(skin != measure_skin) {
+        measure_skin = skin;
+        ++measure_gen;
+        ++cluster_text_gen;
+        box_patch.img.Clear();
     }
 }
 
-/** Compute a natural size for an item (unified or control min / fixed). */
-Size FlowGridLayout::NaturalItemSize(const Item& it) const {
+/** Measure phase: fill the natural-size cache for stale control items from `from` on. */
+void FlowGridLayout::MeasureItems(int from) {
+    SweepRemoved();
+    SyncMeasureSkin();
     if(unified)
-        return unified_sz;
-    if(it.kind == Kind::CtrlItem || it.kind == Kind::GridCell) {
-        Size ms = it.ctrl ? it.ctrl->GetMinSize() : Size(0,0);
-        if(it.fixed.cx > 0 || it.fixed.cy > 0)
-            ms = it.fixed;
-        return ms;
-    }
-    if(it.kind == Kind::Spacer || it.kind == Kind::Gap) {
-        return dir == Direction::H ? Size(it.min_px, DPI(1)) : Size(DPI(1), it.min_px);
-    }
-    if(it.kind == Kind::Expander) {
-        return dir == Direction::H ? Size(0, DPI(1)) : Size(DPI(1), 0);
+        return;
+    for(int i = max(from, 0); i < items.GetCount(); ++i)
+        if(FlowGridEngine::IsCtrl(engine.GetKind(i)) && items[i].measured != measure_gen)
+            MeasureItem(i);
+}
+
+/** Drop one item's cached natural size. */
+FlowGridLayout& FlowGridLayout::InvalidateItemSize(int handle) {
+    int index = GetIndex(handle);
+    if(index >= 0) {
+        items[index].measured = -1;
+        Reflow(index, index);
     }
-    return Size(0,0);
+    return *this;
 }
 
 /** Show/hide and configure scrollbars based on content vs view. */
@@ -327,94 +602,305 @@ void FlowGridLayout::UpdateScrollbars() {
     updating_sb = false;
 }
 
-/** Apply scrollbar thumbs to origin; repaint only (no relayout). */
-void FlowGridLayout::ApplyScrollbars() {
+/** Largest origin per axis; 0 on axes the scroll policy does not allow. */
+Size FlowGridLayout::ScrollLimit() const {
     const Size page = GetView().GetSize();
-    Point p = sb.Get();
+    Size m(max(0, content.cx - page.cx), max(0, content.cy - page.cy));
+    if(scroll == FGLScroll::None || scroll == FGLScroll::VerticalOnly)
+        m.cx = 0;
+    if(scroll == FGLScroll::None || scroll == FGLScroll::HorizontalOnly)
+        m.cy = 0;
+    return m;
+}
 
-    const int maxx = max(0, content.cx - page.cx);
-    const int maxy = max(0, content.cy - page.cy);
-    p.x = minmax(p.x, 0, maxx);
-    p.y = minmax(p.y, 0, maxy);
+/** Clamp `p` to the content and make it the origin; scrolls pixels and visible children (no relayout). */
+void FlowGridLayout::ScrollTo(Point p) {
+    const Size m = ScrollLimit();
+    p.x = minmax(p.x, 0, m.cx);
+    p.y = minmax(p.y, 0, m.cy);
 
     if(p != origin) {
+        Point d = p - origin;
+        Point old_origin = origin;
         origin = p;
-        Refresh();
+        if(virtual_mode)
+            SyncVirtual();
+        else
+            ScrollChildren(old_origin);
+        ScrollView(-d.x, -d.y); // blit; only the exposed strip is painted
+        UpdateAnchor();
     }
 }
 
-/** Layout dispatcher: Grid vs Flow; computes content and updates scrollbars. */
-void FlowGridLayout::Layout() {
-    if(laying_out)
+/** Remember the first item in the view and its view position (scroll anchoring). */
+void FlowGridLayout::UpdateAnchor() {
+    anchor_handle = -1;
+    if(!scroll_anchoring || virtual_mode || origin == Point(0,0))
         return;
-    laying_out = true;
+    moved.Clear(); // scratch; only needed within a placement pass
+    engine.ItemsIn(GetView().Offseted(origin), moved);
+    for(int i : moved)
+        if(items[i].handle >= 0) {
+            anchor_handle = items[i].handle;
+            anchor_pos    = engine.GetItemRect(i).TopLeft() - origin;
+            break;
+        }
+}
 
-    Rect r = GetView();
-    r.Deflate(style.padding);
+/**
+ * Move the origin by the anchor's displacement in the new layout, before any
+ * child is placed, so the pass that moved the content also compensates for it.
+ * UpdateScrollbars() then clamps the origin and updates the bars.
+ */
+void FlowGridLayout::ApplyAnchor() {
+    if(anchor_handle < 0 || !scroll_anchoring || virtual_mode)
+        return;
+    int i = GetIndex(anchor_handle);
+    if(i < 0)
+        return;
+    Point d = engine.GetItemRect(i).TopLeft() - origin - anchor_pos;
+    if(d == Point(0,0))
+        return;
+    origin += d;
+    if(scroll_pending)
+        scroll_target += d; // a wheel scroll in flight keeps its remaining distance
+    Refresh();
+}
 
-    if(mode == FGLMode::Grid) {
-        //----- Grid: measure columns/rows, then place cells -------------------
-        int maxrow = -1, maxcol = -1;
-        for(const Item& it : items)
-            if(it.kind == Kind::GridCell || it.kind == Kind::BlankGrid) {
-                maxrow = max(maxrow, it.row);
-                maxcol = max(maxcol, it.col);
-            }
+/** Wheel: three text lines per notch; shift turns vertical wheels horizontal.
+    Passed on to the parent when this view cannot scroll at all. */
+void FlowGridLayout::MouseWheel(Point p, int zdelta, dword keyflags) {
+    int d = -zdelta * 3 * GetStdFontCy() / 120;
+    if(!ScrollBy(keyflags & K_SHIFT ? Point(d, 0) : Point(0, d)))
+        Ctrl::MouseWheel(p, zdelta, keyflags);
+}
 
-        const int rows = maxrow + 1, cols = max(maxcol + 1, 0);
-        Vector<int> colw, rowh;
-        colw.SetCount(cols, 0);
-        rowh.SetCount(max(0, rows), 0);
-
-        // Natural widths/heights per column/row
-        for(const Item& it : items)
-            if(it.kind == Kind::GridCell) {
-                Size ns = NaturalItemSize(it);
-                colw[it.col] = max(colw[it.col], ns.cx);
-                rowh[it.row] = max(rowh[it.row], ns.cy);
-            }
+/** Horizontal wheel / touchpad swipe. */
+void FlowGridLayout::HorzMouseWheel(Point p, int zdelta, dword keyflags) {
+    if(!ScrollBy(Point(-zdelta * 3 * GetStdFontCy() / 120, 0)))
+        Ctrl::HorzMouseWheel(p, zdelta, keyflags);
+}
 
-        // Add spacing between columns/rows
-        for(int c = 0; c < colw.GetCount(); ++c) if(c) colw[c] += style.spacing;
-        for(int rr = 0; rr < rowh.GetCount(); ++rr) if(rr) rowh[rr] += style.spacing;
+/** Accumulate a wheel delta into the scroll target; applied on the next frame.
+    Returns false, leaving the event unused, when no axis can scroll. */
+bool FlowGridLayout::ScrollBy(Point d) {
+    const Size m = ScrollLimit();
+    if(m == Size(0, 0))
+        return false;
+    Point t = (scroll_pending ? scroll_target : origin) + d;
+    scroll_target.x = minmax(t.x, 0, m.cx);
+    scroll_target.y = minmax(t.y, 0, m.cy);
+    scroll_glide = smooth_scroll;
+    RequestScrollFrame();
+    return true;
+}
 
-        // Place cells
-        for(int i = 0; i < items.GetCount(); ++i) {
-            Item& it = items[i];
-            if(it.kind != Kind::GridCell)
-                continue;
+/** Schedule one scroll frame unless one is already pending (coalesces input bursts). */
+void FlowGridLayout::RequestScrollFrame() {
+    if(scroll_pending)
+        return;
+    scroll_pending = true;
+    SetTimeCallback(scroll_glide ? 16 : 0, [=] { ScrollFrame(); }, TIMEID_SCROLL);
+}
 
-            int px = r.left;  for(int c = 0; c < it.col; ++c) px += colw[c];
-            int py = r.top;   for(int rr = 0; rr < it.row; ++rr) py += rowh[rr];
+/** One origin update per frame: jump to the target, or glide a third of the way. */
+void FlowGridLayout::ScrollFrame() {
+    scroll_pending = false;
+    Point p = scroll_target;
+    if(scroll_glide) {
+        auto Step = [](int d) { return d / 3 ? d / 3 : sgn(d); };
+        p = origin + Point(Step(scroll_target.x - origin.x), Step(scroll_target.y - origin.y));
+    }
+    sb.Set(p);
+    ScrollTo(p);
+    if(scroll_glide && origin != scroll_target && p == origin)
+        RequestScrollFrame();
+}
 
-            Size cell( colw[it.col] - (it.col ? style.spacing : 0),
-                       rowh[it.row] - (it.row ? style.spacing : 0) );
+/**
+ * Scroll path: re-place only the children whose cells meet the old or the new
+ * window. Everything else was outside the old view and stays outside it, so a
+ * stale position is never visible; the next Layout() re-applies all rects.
+ */
+void FlowGridLayout::ScrollChildren(Point old_origin) {
+    if(engine.IsUniform()) {
+        PlaceVisible();
+        return;
+    }
+    const Rect view = GetView();
+    moved.Clear();
+    engine.ItemsIn(view.Offseted(old_origin), moved);
+    engine.ItemsIn(view.Offseted(origin), moved);
+    for(int i : moved)
+        if(Ctrl *c = items[i].ctrl) {
+            Rect r = engine.GetPlace(i).Offseted(-origin);
+            if(c->GetRect() != r) {
+                c->SetRect(r);
+                ++stats.set_rect;
+            }
+        }
+}
 
-            it.rect = RectC(px, py, cell.cx, cell.cy); // cell area
+/**
+ * Move the controls of items [lo, hi) to their engine placement (view
+ * coordinates). Targets are staged first and only controls whose rect actually
+ * changed get SetRect (which re-lays out and invalidates the child); the union
+ * of old and new rects is then refreshed once for the cluster decorations.
+ */
+void FlowGridLayout::ApplyPlacement(int lo, int hi) {
+    hi = min(hi, items.GetCount());
+    moved.Clear();
+    for(int i = max(lo, 0); i < hi; ++i)
+        if(Ctrl *c = items[i].ctrl)
+            if(c->GetRect() != engine.GetPlace(i).Offseted(-origin))
+                moved.Add(i);
+
+    Rect dirty(0,0,0,0);
+    for(int i : moved) {
+        Ctrl& c = *items[i].ctrl;
+        Rect  r = engine.GetPlace(i).Offseted(-origin);
+        Rect  u = c.GetRect().IsEmpty() ? r : (c.GetRect() | r);
+        dirty = dirty.IsEmpty() ? u : (dirty | u);
+        c.SetRect(r);
+    }
+    stats.set_rect += moved.GetCount();
+    if(!dirty.IsEmpty())
+        Refresh(dirty);
+}
 
-            // Control size: either scaled to cell or natural clamped to cell
-            Size want = it.scale_to_cell ? cell : NaturalItemSize(it);
-            want.cx = min(want.cx, cell.cx);
-            want.cy = min(want.cy, cell.cy);
+/**
+ * Closed-form layouts position only the children in the view: the ones that
+ * left it are parked at an empty rect, so no stale child can show up after a
+ * relayout or resize. The first such pass parks every other child once.
+ */
+void FlowGridLayout::PlaceVisible() {
+    moved.Clear();
+    engine.ItemsIn(GetView().Offseted(origin), moved);
+    if(!parked) {
+        for(Item& it : items)
+            if(it.ctrl && !it.ctrl->GetRect().IsEmpty()) {
+                it.ctrl->SetRect(Rect(0,0,0,0));
+                ++stats.set_rect;
+            }
+        placed.Clear();
+        parked = true;
+    }
 
-            if(it.ctrl)
-                it.ctrl->SetRect(px - origin.x, py - origin.y, want.cx, want.cy);
+    // Both lists are ascending: park what is in `placed` but not in `moved`
+    int k = 0;
+    for(int i : placed) {
+        while(k < moved.GetCount() && moved[k] < i)
+            ++k;
+        if((k == moved.GetCount() || moved[k] != i) && i < items.GetCount() && items[i].ctrl) {
+            items[i].ctrl->SetRect(Rect(0,0,0,0));
+            ++stats.set_rect;
+        }
+    }
+    for(int i : moved)
+        if(Ctrl *c = items[i].ctrl) {
+            Rect r = engine.GetPlace(i).Offseted(-origin);
+            if(c->GetRect() != r) {
+                c->SetRect(r);
+                ++stats.set_rect;
+            }
         }
+    placed = pick(moved);
+}
+
+/** Measure phase of a pass: skin/generation check, then stale items from the first dirty one. */
+void FlowGridLayout::MeasurePending() {
+    StatTimer t(stats_on, stats.measure_us);
+    SweepRemoved();
+    SyncMeasureSkin();
+    if(measure_gen != last_measure_gen) {
+        engine.Invalidate();
+        last_measure_gen = measure_gen;
+    }
+    if(!virtual_mode)
+        MeasureItems(engine.GetDirtyFrom());
+}
+
+/**
+ * Coalesce relayout requests: the first one posts a zero-delay callback, later
+ * ones (a setter chain, a batch of Add*) only widen the engine's dirty range.
+ */
+void FlowGridLayout::ScheduleLayout() {
+    if(layout_scheduled)
+        return;
+    layout_scheduled = true;
+    SetTimeCallback(0, [=] { if(layout_scheduled) RefreshLayout(); }, TIMEID_REFLOW);
+}
+
+/** Layout driver: measure, run the engine (here or on a worker), then apply. */
+void FlowGridLayout::Layout() {
+    if(layout_scheduled) { // resizes and FlushLayout() both satisfy the request
+        KillTimeCallback(TIMEID_REFLOW);
+        layout_scheduled = false;
+    }
+    if(laying_out)
+        return;
+
+    if(async_layout) {
+        if(async_busy)
+            async_again = true;
+        else
+            StartAsyncLayout();
+        return;
+    }
+    LayoutSync(false);
+}
+
+/** Measure, run the engine on this thread and apply (all children if `all`). */
+void FlowGridLayout::LayoutSync(bool all) {
+    laying_out = true;
+    MeasurePending();
+    {
+        StatTimer t(stats_on, stats.break_us);
+        engine.Layout(GetView(), GetOptions());
+    }
+    FinishLayout(all);
+}
 
-        // Content size: sum columns/rows + padding on both sides
-        int totalw = 0, totalh = 0;
-        for(int c = 0; c < colw.GetCount(); ++c) totalw += colw[c];
-        for(int rr = 0; rr < rowh.GetCount(); ++rr) totalh += rowh[rr];
-        content = Size(totalw + 2 * style.padding, totalh + 2 * style.padding);
+/** Run a pending layout now; in async mode, on this thread instead of a worker. */
+FlowGridLayout& FlowGridLayout::FlushLayout() {
+    if(laying_out)
+        return *this;
+    if(async_layout && (layout_scheduled || async_busy)) {
+        KillTimeCallback(TIMEID_REFLOW);
+        layout_scheduled = false;
+        DropAsyncLayout();
+        engine.Invalidate(); // the dirty range went to the dropped snapshot
+        LayoutSync(true);
     }
-    else {
-        //----- Flow -----------------------------------------------------------
-        if(dir == Direction::H)
-            LayoutHorizontal();
+    else
+    if(layout_scheduled)
+        RefreshLayout();
+    return *this;
+}
+
+/** Apply the engine result: child rects, cluster index, content and scrollbars. */
+void FlowGridLayout::FinishLayout(bool all) {
+    StatTimer t(stats_on, stats.place_us);
+    ++stats.layouts;
+    laying_out = true;
+    content = engine.GetContentSize();
+    ApplyAnchor();
+
+    if(!virtual_mode) {
+        // A scrolled origin moves every control; otherwise only re-placed ones.
+        if(engine.IsUniform())
+            PlaceVisible();
         else
-            LayoutVertical();
-        // content is set in the flow passes
+        if(all || parked || origin != last_origin) {
+            parked = false;
+            placed.Clear();
+            ApplyPlacement(0, items.GetCount());
+        }
+        else
+            ApplyPlacement(engine.GetDoneLo(), engine.GetDoneHi());
+        BuildClusterIndex();
     }
+    last_origin = origin;
 
     // Notify on content change
     if(content != last_reported_content) {
@@ -425,6 +911,158 @@ void FlowGridLayout::Layout() {
 
     laying_out = false;
     UpdateScrollbars();
+    if(virtual_mode)
+        SyncVirtual(); // origin is clamped now
+    else
+    if(origin != last_origin) { // content shrank under a scrolled view
+        if(engine.IsUniform())
+            PlaceVisible();
+        else
+            ApplyPlacement(0, items.GetCount());
+        last_origin = origin;
+        Refresh();
+    }
+    UpdateAnchor();
+}
+
+//==============================================================================
+// Asynchronous layout
+//==============================================================================
+
+/** Turn worker-thread layout on/off; switching drops any in-flight result. */
+FlowGridLayout& FlowGridLayout::SetAsyncLayout(bool on) {
+    if(async_layout == on)
+        return *this;
+    DropAsyncLayout();
+    async_layout = on;
+    engine.Invalidate(); // the GUI engine may hold lines older than its dirty range
+    Reflow();
+    return *this;
+}
+
+/** Wait for a worker pass in flight and discard its result. */
+void FlowGridLayout::DropAsyncLayout() {
+    async_work.Finish();
+    KillTimeCallback(TIMEID_ASYNC);
+    {
+        Mutex::Lock __(async_lock);
+        async_done.Clear();
+    }
+    async_busy = async_again = false;
+}
+
+/** Measure here, then lay out a model snapshot on a worker (always a full pass). */
+void FlowGridLayout::StartAsyncLayout() {
+    MeasurePending();
+
+    FlowGridEngine *e = new FlowGridEngine(engine, 0);
+    e->FreezeVirtualSizes(); // the worker must not call back into the owner
+    engine.ClearDirty();     // handed over to the snapshot
+
+    const int  gen  = layout_gen;
+    const Rect view = GetView();
+    const FlowGridEngine::Options o = GetOptions();
+    const bool timed = stats_on;
+    async_busy = true;
+    async_work & [=] {
+        int64 t0 = timed ? usecs() : 0;
+        e->Layout(view, o);
+        {
+            Mutex::Lock __(async_lock);
+            async_done.Attach(e); // at most one pass is in flight
+            async_done_gen = gen;
+            async_done_us  = timed ? usecs() - t0 : 0;
+        }
+        SetTimeCallback(0, [=] { AdoptAsyncLayout(); }, TIMEID_ASYNC);
+    };
+}
+
+/** GUI thread: swap in a finished engine unless the model changed meanwhile. */
+void FlowGridLayout::AdoptAsyncLayout() {
+    One<FlowGridEngine> e;
+    int gen;
+    {
+        Mutex::Lock __(async_lock);
+        e = pick(async_done);
+        gen = async_done_gen;
+        stats.break_us += async_done_us;
+    }
+    async_busy = false;
+    if(!async_layout)
+        return;
+
+    if(e && gen == layout_gen) {
+        Function<Size(int)> vs = pick(engine.vsize);
+        Function<int(int)>  rs = pick(engine.vrow_size), cs = pick(engine.vcol_size);
+        FlowGridEngine::Counters cn = engine.counters;
+        engine = pick(*e);
+        engine.vsize = pick(vs);
+        engine.vrow_size = pick(rs);
+        engine.vcol_size = pick(cs);
+        engine.counters = cn;
+        engine.ThawVirtualSizes();
+        FinishLayout(true);
+        Refresh();
+    }
+    if(async_again || gen != layout_gen) {
+        async_again = false;
+        StartAsyncLayout();
+    }
+}
+
+/**
+ * Compute natural total height for a given total width (including padding).
+ * This method is a *probe*: it does not change child rects or scroll state.
+ */
+int FlowGridLayout::MeasureHeightForWidth(int total_width) {
+    {
+        StatTimer t(stats_on, stats.measure_us);
+        MeasureItems();
+    }
+    return engine.MeasureHeightForWidth(total_width, GetOptions());
+}
+
+//==============================================================================
+// Geometry queries
+//==============================================================================
+
+/** Item under a view point: line (or row/column) search, then a search within it. */
+int FlowGridLayout::ItemAt(Point p) const {
+    int i = engine.ItemAt(p + origin);
+    return virtual_mode || i < 0 ? i : items[i].handle;
+}
+
+/** Items intersecting a view rect; cost is proportional to the lines/rows it spans. */
+Vector<int> FlowGridLayout::ItemsIn(const Rect& r) const {
+    Vector<int> out;
+    engine.ItemsIn(r.Offseted(origin), out);
+    if(!virtual_mode) {
+        int n = 0;
+        for(int i : out)
+            if(items[i].handle >= 0)
+                out[n++] = items[i].handle;
+        out.Trim(n);
+    }
+    return out;
+}
+
+/** Cluster under a view point (via the cluster index), or -1. */
+int FlowGridLayout::ClusterAt(Point p) const {
+    Point cp = p + origin;
+    int hit = -1;
+    cluster_index.Query(RectC(cp.x, cp.y, 1, 1), [&](int i, const Rect&) {
+        if(hit < 0 && engine.clusters[i].bounds.Contains(cp))
+            hit = i;
+    });
+    return hit;
+}
+
+/** Cell rect of an item (or virtual tile) in view coordinates. */
+Rect FlowGridLayout::GetItemRect(int handle) const {
+    int index = virtual_mode ? handle : GetIndex(handle);
+    if(index < 0)
+        return Rect(0,0,0,0);
+    return engine.GetItemRect(index).Offseted(-origin);
 }
 
 //==============================================================================
@@ -449,35 +1087,161 @@ static inline void FillRoundedRect(Draw& w, Rect r, int rad, Color col) {
     w.DrawEllipse(Rect(r.right - 2*rx,   r.bottom - 2*ry,  2*rx, 2*ry), col);
 }
 
-/** Paint a cluster rounded box using Style colors. */
-static inline void PaintClusterBox(Draw& w, const Rect& r, const FlowGridLayout::Style& st) {
-    FillRoundedRect(w, r, st.cluster_box_radius, st.cluster_box_border);
-    Rect inner = r.Deflated(1);
-    int  inner_rad = max(0, st.cluster_box_radius - 1);
-    FillRoundedRect(w, inner, inner_rad, st.cluster_box_bg);
+/** Cluster rounded box: border fill, then the background inset by one pixel. */
+static void FillClusterBox(Draw& w, const Rect& r, int rad, Color border, Color bg) {
+    FillRoundedRect(w, r, rad, border);
+    FillRoundedRect(w, r.Deflated(1), max(0, rad - 1), bg);
+}
+
+/**
+ * Nine-patch source for cluster boxes: a (2r+1)-pixel square holding the four
+ * corners with alpha. It is rendered once and kept until the radius or colors
+ * change, SetStyle() is called or the skin (DPI/font) changes.
+ */
+const Image& FlowGridLayout::ClusterBoxPatch() {
+    BoxPatch& p = box_patch;
+    int rad = style.cluster_box_radius;
+    if(p.img && p.radius == rad && p.border == style.cluster_box_border && p.bg == style.cluster_box_bg)
+        return p.img;
+    int n = 2 * rad + 1;
+    ImageDraw iw(n, n);
+    iw.Alpha().DrawRect(0, 0, n, n, GrayColor(0));
+    FillRoundedRect(iw.Alpha(), Rect(0, 0, n, n), rad, GrayColor(255));
+    FillClusterBox(iw, Rect(0, 0, n, n), rad, style.cluster_box_border, style.cluster_box_bg);
+    p.img    = iw;
+    p.radius = rad;
+    p.border = style.cluster_box_border;
+    p.bg     = style.cluster_box_bg;
+    return p.img;
+}
+
+/**
+ * Paint a cluster box from the cached nine-patch. Only the corners carry
+ * curves, so they are blitted; the straight edges and the center are solid
+ * fills. Boxes too small for full corners fall back to direct drawing.
+ */
+void FlowGridLayout::PaintClusterBox(Draw& w, const Rect& r) {
+    int rad = style.cluster_box_radius;
+    if(rad <= 0 || r.GetWidth() <= 2 * rad || r.GetHeight() <= 2 * rad) {
+        FillClusterBox(w, r, rad, style.cluster_box_border, style.cluster_box_bg);
+        return;
+    }
+    const Image& m = ClusterBoxPatch();
+    w.DrawImage(r.left,        r.top,          m, RectC(0,       0,       rad, rad));
+    w.DrawImage(r.right - rad, r.top,          m, RectC(rad + 1, 0,       rad, rad));
+    w.DrawImage(r.left,        r.bottom - rad, m, RectC(0,       rad + 1, rad, rad));
+    w.DrawImage(r.right - rad, r.bottom - rad, m, RectC(rad + 1, rad + 1, rad, rad));
+
+    Color border = style.cluster_box_border;
+    w.DrawRect(r.left + rad, r.top,        r.GetWidth() - 2 * rad, 1, border);
+    w.DrawRect(r.left + rad, r.bottom - 1, r.GetWidth() - 2 * rad, 1, border);
+    w.DrawRect(r.left,       r.top + rad,  1, r.GetHeight() - 2 * rad, border);
+    w.DrawRect(r.right - 1,  r.top + rad,  1, r.GetHeight() - 2 * rad, border);
+
+    Color bg = style.cluster_box_bg;
+    w.DrawRect(Rect(r.left + rad, r.top + 1, r.right - rad, r.bottom - 1), bg);
+    w.DrawRect(Rect(r.left + 1, r.top + rad, r.left + rad, r.bottom - rad), bg);
+    w.DrawRect(Rect(r.right - rad, r.top + rad, r.right - 1, r.bottom - rad), bg);
+}
+
+/** Sort entries by leading edge and compute the running max of trailing edges. */
+void FlowGridLayout::RectIndex::Finish(bool h) {
+    horz = h;
+    const int n = id.GetCount();
+    Vector<int> order;
+    order.SetCount(n);
+    for(int i = 0; i < n; ++i)
+        order[i] = i;
+    Sort(order, [&](int a, int b) { return horz ? rc[a].left < rc[b].left : rc[a].top < rc[b].top; });
+
+    Vector<int>  sid;
+    Vector<Rect> src;
+    sid.SetCount(n);
+    src.SetCount(n);
+    reach.SetCount(n);
+    int m = INT_MIN;
+    for(int i = 0; i < n; ++i) {
+        sid[i] = id[order[i]];
+        src[i] = rc[order[i]];
+        m = max(m, horz ? src[i].right : src[i].bottom);
+        reach[i] = m;
+    }
+    id = pick(sid);
+    rc = pick(src);
+}
+
+/** Call fn(id, rect) for each entry intersecting `q`. */
+template <class F>
+void FlowGridLayout::RectIndex::Query(const Rect& q, F fn) const {
+    const int qlo = horz ? q.left : q.top, qhi = horz ? q.right : q.bottom;
+    int lo = 0, hi = reach.GetCount();
+    while(lo < hi) { // first entry whose running trailing edge passes qlo
+        int mid = (lo + hi) >> 1;
+        if(reach[mid] <= qlo) lo = mid + 1; else hi = mid;
+    }
+    for(int i = lo; i < rc.GetCount(); ++i) {
+        const Rect& r = rc[i];
+        if((horz ? r.left : r.top) >= qhi)
+            break;
+        if(r.Intersects(q))
+            fn(id[i], r);
+    }
+}
+
+/** Index decorated cluster rects (box padding + header band) for culled paint. */
+void FlowGridLayout::BuildClusterIndex() {
+    cluster_index.Clear();
+    for(int i = 0; i < engine.clusters.GetCount(); ++i) {
+        const Rect& b = engine.clusters[i].bounds;
+        if(b.IsEmpty())
+            continue;
+        Rect r = b.Inflated(style.cluster_box_pad);
+        r.top = min(r.top, b.top - style.group_header_h - DPI(2));
+        cluster_index.Add(i, r);
+    }
+    cluster_index.Finish(dir == Direction::V);
 }
 
-/** Paint rounded boxes for clusters that request one. */
-void FlowGridLayout::PaintClusters(Draw& w) {
-    for(const Cluster& c : clusters) {
-        if(!(c.box || style.cluster_box_default) || c.bounds.IsEmpty()) continue;
-        Rect r = c.bounds.Inflated(style.cluster_box_pad);
+/** Paint rounded boxes for visible clusters that request one. */
+void FlowGridLayout::PaintClusters(Draw& w, const Rect& q) {
+    cluster_index.Query(q, [&](int i, const Rect&) {
+        if(!(clusters[i].box || style.cluster_box_default)) return;
+        Rect r = engine.clusters[i].bounds.Inflated(style.cluster_box_pad);
         r.Offset(-origin);
-        PaintClusterBox(w, r, style);
+        PaintClusterBox(w, r);
+    });
+}
+
+/** Drop one cluster's cached header text. */
+FlowGridLayout& FlowGridLayout::InvalidateClusterText(int id) {
+    if(id >= 0 && id < clusters.GetCount()) {
+        clusters[id].text_gen = -1;
+        Refresh();
+    }
+    return *this;
+}
+
+/** Header text and extent of a cluster, fetched (and measured) only when stale. */
+const FlowGridLayout::Cluster& FlowGridLayout::ClusterText(int id) {
+    Cluster& c = clusters[id];
+    if(c.text_gen != cluster_text_gen) {
+        c.text     = when_group_text ? when_group_text(id) : String().Cat() << "Cluster " << id;
+        c.text_sz  = GetTextSize(c.text, StdFont());
+        c.text_gen = cluster_text_gen;
     }
+    return c;
 }
 
 /** Paint a single cluster header band and optional divider. */
 void FlowGridLayout::PaintGroupHeader(Draw& w, const Rect& r, int cluster_id) {
     if(!style.group_header) return;
-    String txt = when_group_text ? when_group_text(cluster_id)
-                                 : String().Cat() << "Cluster " << cluster_id;
+    const Cluster& c = ClusterText(cluster_id);
     Rect hr = r;
     hr.bottom = hr.top + style.group_header_h;
     hr.Offset(-origin);
     w.DrawRect(hr, Blend(style.face, SColorHighlight(), 10));
-    w.DrawText(hr.left + DPI(8), hr.top + (hr.GetHeight() - GetStdFontCy())/2,
-               txt, StdFont(), SColorText());
+    w.DrawText(hr.left + DPI(8), hr.top + (hr.GetHeight() - c.text_sz.cy)/2,
+               c.text, StdFont(), SColorText());
     if(style.group_divider) {
         Rect dl = hr;
         dl.top = dl.bottom - DPI(1);
@@ -485,538 +1249,45 @@ void FlowGridLayout::PaintGroupHeader(Draw& w, const Rect& r, int cluster_id) {
     }
 }
 
-/** Walk clusters and paint headers (if enabled by style/cluster override). */
-void FlowGridLayout::PaintClusterHeaders(Draw& w) {
+/** Paint headers of visible clusters (if enabled by style/cluster override). */
+void FlowGridLayout::PaintClusterHeaders(Draw& w, const Rect& q) {
     if(!style.group_header || style.group_header_h <= 0)
         return;
 
-    for(int i = 0; i < clusters.GetCount(); ++i) {
+    cluster_index.Query(q, [&](int i, const Rect&) {
         const Cluster& c = clusters[i];
-        if(c.bounds.IsEmpty())
-            continue;
 
         // Effective header: per-cluster or default
         bool show = (c.header >= 0) ? (c.header != 0) : default_cluster_header;
         if(!show)
-            continue;
+            return;
 
-        Rect r = c.bounds;
+        Rect r = engine.clusters[i].bounds;
         r.top   -= style.group_header_h + DPI(2);
         r.bottom = r.top + style.group_header_h;
 
         PaintGroupHeader(w, r, i);
-    }
+    });
 }
 
 
-/** Paint face, cluster boxes, headers, and (optional) debug overlay. */
+/** Paint face, then only the cluster boxes, headers and debug cells under the paint rect. */
 void FlowGridLayout::Paint(Draw& w) {
+    StatTimer t(stats_on, stats.paint_us);
     w.DrawRect(GetSize(), style.face);
-    PaintClusters(w);
-    PaintClusterHeaders(w);
-    DebugPaint(w);
-}
-
-//==============================================================================
-// Flow passes (LeftToRight / TopToBottom)
-//==============================================================================
-
-/** Flow pass for LeftToRight direction (wrap-aware). Computes content size. */
-void FlowGridLayout::LayoutHorizontal() {
-    Rect vr = GetView();  
-    vr.Deflate(style.padding);
-    int x = vr.left, y = vr.top;
-    int line_h = 0;
-
-    for(Cluster& cl : clusters) cl.bounds = Rect(0,0,0,0);
-
-    // Commit a laid-out line [from, to)
-    auto CommitLine = [&](int from, int to, int free_px) {
-        // distribute to spacers
-        int count_sp = 0; for(int i=from;i<to;i++) if(items[i].kind==Kind::Spacer) count_sp++;
-        if(count_sp) {
-            for(int i=from;i<to;i++) if(items[i].kind==Kind::Spacer) {
-                int grow = min(items[i].max_px - items[i].min_px, free_px / max(count_sp,1));
-                items[i].rect.SetSize(Size(items[i].min_px + max(0,grow), line_h));
-                free_px -= max(0,grow);
-            }
-        }
-        // expanders proportionally
-        int wsum = 0; for(int i=from;i<to;i++) if(items[i].kind==Kind::Expander) wsum += max(1, items[i].weight);
-        if(wsum > 0 && free_px > 0) {
-            for(int i=from;i<to;i++) if(items[i].kind==Kind::Expander) {
-                int got = free_px * max(1, items[i].weight) / wsum;
-                items[i].rect.SetSize(Size(got, line_h));
-            }
-        }
-        // place cells and controls
-        int lx = vr.left;
-        for(int i=from;i<to;i++) {
-            Item& it = items[i];
-            if(it.kind == Kind::Break) continue; // nothing to render
-
-            // Cell width (pre-sized by Spacer/Expander SetSize or natural)
-            Size ns_base = it.rect.GetSize();
-            if(ns_base.cx == 0 || ns_base.cy == 0) {
-                Size nat = NaturalItemSize(it);
-                ns_base = Size((ns_base.cx ? ns_base.cx : nat.cx), line_h);
-            }
-            Rect cell = RectC(lx, y, ns_base.cx, line_h);
-            it.rect = cell; // keep union basis for cluster bounds
-
-            // Control rectangle within 'cell' based on cross-axis alignment
-            if(it.ctrl) {
-                Size want = it.scale_to_cell ? cell.GetSize() : NaturalItemSize(it);
-                want.cx = min(want.cx, cell.GetWidth());
-                want.cy = min(want.cy, cell.GetHeight());
-
-                Rect cr = cell;
-                if(it.scale_to_cell) {
-                    cr = cell;
-                } else {
-                    switch(align_items) {
-                        case Stretch:
-                            cr.top = cell.top;
-                            cr.bottom = cell.bottom;
-                            cr.left = cell.left;
-                            cr.right = cell.left + want.cx;
-                            break;
-                        case Start:
-                            cr.top = cell.top;
-                            cr.bottom = cell.top + want.cy;
-                            cr.left = cell.left;
-                            cr.right = cell.left + want.cx;
-                            break;
-                        case Center:
-                            cr.top = cell.top + (cell.GetHeight() - want.cy)/2;
-                            cr.bottom = cr.top + want.cy;
-                            cr.left = cell.left;
-                            cr.right = cell.left + want.cx;
-                            break;
-                        case End:
-                            cr.bottom = cell.bottom;
-                            cr.top = cr.bottom - want.cy;
-                            cr.left = cell.left;
-                            cr.right = cell.left + want.cx;
-                            break;
-                        case Auto:
-                        default:
-                            cr.top = cell.top + (cell.GetHeight() - want.cy)/2;
-                            cr.bottom = cr.top + want.cy;
-                            cr.left = cell.left;
-                            cr.right = cell.left + want.cx;
-                            break;
-                    }
-                }
-                it.ctrl->SetRect(cr.left - origin.x, cr.top - origin.y,
-                                 cr.GetWidth(), cr.GetHeight());
-            }
-
-            if(it.cluster >= 0) {
-                Cluster& cl = clusters[it.cluster];
-                cl.bounds = cl.bounds.IsEmpty() ? cell : (cl.bounds | cell);
-            }
-            lx += cell.GetWidth() + style.spacing;
-        }
-    };
-
-    int line_start = 0;
-    int used_w = 0;
-    line_h = 0;
-
-    auto NaturalW = [&](const Item& it)->int {
-        Size ns = NaturalItemSize(it);
-        if(it.kind==Kind::Spacer)   return it.min_px;
-        if(it.kind==Kind::Gap)      return it.min_px;
-        if(it.kind==Kind::Expander) return 0;
-        return ns.cx;
-    };
-
-    for(int i=0;i<items.GetCount();++i) {
-        Item& it = items[i];
-        if(it.kind==Kind::GridCell || it.kind==Kind::BlankGrid) continue;
-
-        // Hard break commits current line if there's content.
-        if(it.kind == Kind::Break) {
-            if(i > line_start) {
-                int free_px = (vr.right - vr.left) - (used_w ? (used_w - style.spacing) : 0);
-                CommitLine(line_start, i, max(0, free_px));
-                y += line_h + style.spacing;
-                x = vr.left;
-                line_h = 0;
-                line_start = i + 1;
-                used_w = 0;
-            } else {
-                line_start = i + 1;
-            }
-            continue;
-        }
-
-        // Atomic cluster (no internal wrap)
-        if(it.cluster >= 0 && !clusters[it.cluster].flow) {
-            int j=i, cw=0, ch=0;
-            while(j<items.GetCount() && items[j].cluster==it.cluster &&
-                 !(items[j].kind==Kind::GridCell||items[j].kind==Kind::BlankGrid||items[j].kind==Kind::Break)) {
-                cw += NaturalW(items[j]);
-                ch = max(ch, NaturalItemSize(items[j]).cy);
-                if(j>i) cw += style.spacing;
-                j++;
-            }
-            if(wrap && (x + cw > vr.right+1) && i>line_start) {
-                int free_px = (vr.right - vr.left) - (used_w ? (used_w - style.spacing) : 0);
-                CommitLine(line_start, i, max(0, free_px));
-                y += line_h + style.spacing;
-                x = vr.left;
-                line_h = 0;
-                line_start = i;
-                used_w = 0;
-            }
-            for(int k=i;k<j;k++) {
-                Size ns = NaturalItemSize(items[k]);
-                items[k].rect = RectC(0,0, ns.cx, max(ns.cy, ch));
-                used_w += ns.cx + (k>i?style.spacing:0);
-                line_h = max(line_h, ns.cy);
-            }
-            x += cw + style.spacing;
-            i = j-1;
-            continue;
-        }
-
-        Size ns = NaturalItemSize(it);
-        int needw = NaturalW(it);
-        if(wrap && x != vr.left && (x + needw > vr.right+1)) {
-            int free_px = (vr.right - vr.left) - (used_w ? (used_w - style.spacing) : 0);
-            CommitLine(line_start, i, max(0, free_px));
-            y += line_h + style.spacing;
-            x = vr.left;
-            line_h = 0;
-            line_start = i;
-            used_w = 0;
-        }
-        it.rect = RectC(0,0, needw, ns.cy); // temp; finalized in CommitLine
-        used_w += needw + (i>line_start?style.spacing:0);
-        line_h = max(line_h, ns.cy);
-        x += needw + style.spacing;
-    }
-
-    if(line_start < items.GetCount()) {
-        int free_px = (vr.right - vr.left) - (used_w ? (used_w - style.spacing) : 0);
-        CommitLine(line_start, items.GetCount(), max(0, free_px));
-    }
-
-    Rect cb = Rect(vr.left, vr.top, vr.left, vr.top);
-    bool first = true;
-    for(const Item& it : items) {
-        if(it.kind==Kind::GridCell||it.kind==Kind::BlankGrid) continue;
-        if(first) { cb = it.rect; first=false; }
-        else cb |= it.rect;
-    }
-    if(first) cb = RectC(vr.left, vr.top, 0, 0);
-    cb.Inflate(style.padding);
-    content = cb.GetSize();
-}
-
-/** Flow pass for TopToBottom direction (wrap-aware). Computes content size. */
-void FlowGridLayout::LayoutVertical() {
-    Rect vr = GetView();
-    vr.Deflate(style.padding);
-    int x = vr.left, y = vr.top;
-    int line_w = 0;
-
-    for(Cluster& cl : clusters) cl.bounds = Rect(0,0,0,0);
-
-    // Commit a laid-out column [from, to)
-    auto CommitCol = [&](int from, int to, int free_px) {
-        int count_sp = 0; for(int i=from;i<to;i++) if(items[i].kind==Kind::Spacer) count_sp++;
-        if(count_sp) {
-            for(int i=from;i<to;i++) if(items[i].kind==Kind::Spacer) {
-                int grow = min(items[i].max_px - items[i].min_px, free_px / max(count_sp,1));
-                items[i].rect.SetSize(Size(line_w, items[i].min_px + max(0,grow)));
-                free_px -= max(0,grow);
-            }
-        }
-        int wsum = 0; for(int i=from;i<to;i++) if(items[i].kind==Kind::Expander) wsum += max(1, items[i].weight);
-        if(wsum > 0 && free_px > 0) {
-            for(int i=from;i<to;i++) if(items[i].kind==Kind::Expander) {
-                int got = free_px * max(1, items[i].weight) / wsum;
-                items[i].rect.SetSize(Size(line_w, got));
-            }
-        }
-        int ly = vr.top;
-        for(int i=from;i<to;i++) {
-            Item& it = items[i];
-            if(it.kind == Kind::Break) continue;
-
-            Size ns_base = it.rect.GetSize();
-            if(ns_base.cx == 0 || ns_base.cy == 0) {
-                Size nat = NaturalItemSize(it);
-                ns_base = Size(line_w, (ns_base.cy ? ns_base.cy : nat.cy));
-            }
-            Rect cell = RectC(x, ly, line_w, ns_base.cy);
-            it.rect = cell;
-
-            if(it.ctrl) {
-                Size want = it.scale_to_cell ? cell.GetSize() : NaturalItemSize(it);
-                want.cx = min(want.cx, cell.GetWidth());
-                want.cy = min(want.cy, cell.GetHeight());
-
-                Rect cr = cell;
-                if(it.scale_to_cell) {
-                    cr = cell;
-                } else {
-                    switch(align_items) {
-                        case Stretch:
-                            cr.left = cell.left;
-                            cr.right= cell.right;
-                            cr.top  = cell.top;
-                            cr.bottom = cell.top + want.cy;
-                            break;
-                        case Start:
-                            cr.left = cell.left;
-                            cr.right= cell.left + want.cx;
-                            cr.top  = cell.top;
-                            cr.bottom = cell.top + want.cy;
-                            break;
-                        case Center:
-                            cr.left = cell.left + (cell.GetWidth() - want.cx)/2;
-                            cr.right= cr.left + want.cx;
-                            cr.top  = cell.top;
-                            cr.bottom = cell.top + want.cy;
-                            break;
-                        case End:
-                            cr.right = cell.right;
-                            cr.left  = cr.right - want.cx;
-                            cr.top   = cell.top;
-                            cr.bottom= cell.top + want.cy;
-                            break;
-                        case Auto:
-                        default:
-                            cr.left = cell.left + (cell.GetWidth() - want.cx)/2;
-                            cr.right= cr.left + want.cx;
-                            cr.top  = cell.top;
-                            cr.bottom = cell.top + want.cy;
-                            break;
-                    }
-                }
-
-                it.ctrl->SetRect(cr.left - origin.x, cr.top - origin.y,
-                                 cr.GetWidth(), cr.GetHeight());
-            }
-
-            if(it.cluster >= 0) {
-                Cluster& cl = clusters[it.cluster];
-                cl.bounds = cl.bounds.IsEmpty() ? cell : (cl.bounds | cell);
-            }
-            ly += cell.GetHeight() + style.spacing;
-        }
-    };
-
-    int col_start = 0;
-    int used_h = 0;
-    line_w = 0;
-
-    auto NaturalH = [&](const Item& it)->int {
-        Size ns = NaturalItemSize(it);
-        if(it.kind==Kind::Spacer)   return it.min_px;
-        if(it.kind==Kind::Gap)      return it.min_px;
-        if(it.kind==Kind::Expander) return 0;
-        return ns.cy;
-    };
-
-    for(int i=0;i<items.GetCount();++i) {
-        Item& it = items[i];
-        if(it.kind==Kind::GridCell || it.kind==Kind::BlankGrid) continue;
-
-        if(it.kind == Kind::Break) {
-            if(i > col_start) {
-                int free_px = (vr.bottom - vr.top) - (used_h ? (used_h - style.spacing) : 0);
-                CommitCol(col_start, i, max(0, free_px));
-                x += line_w + style.spacing;
-                y = vr.top;
-                col_start = i + 1;
-                used_h = 0;
-                line_w = 0;
-            } else {
-                col_start = i + 1;
-            }
-            continue;
-        }
-
-        if(it.cluster >= 0 && !clusters[it.cluster].flow) {
-            int j=i, ch=0, cw=0;
-            while(j<items.GetCount() && items[j].cluster==it.cluster &&
-                 !(items[j].kind==Kind::GridCell||items[j].kind==Kind::BlankGrid||items[j].kind==Kind::Break)) {
-                ch += NaturalH(items[j]);
-                cw = max(cw, NaturalItemSize(items[j]).cx);
-                if(j>i) ch += style.spacing;
-                j++;
-            }
-            if(wrap && (y + ch > vr.bottom+1) && i>col_start) {
-                int free_px = (vr.bottom - vr.top) - (used_h ? (used_h - style.spacing) : 0);
-                CommitCol(col_start, i, max(0, free_px));
-                x += line_w + style.spacing;
-                y = vr.top;
-                col_start = i;
-                used_h = 0;
-                line_w = 0;
-            }
-            for(int k=i;k<j;k++) {
-                Size ns = NaturalItemSize(items[k]);
-                items[k].rect = RectC(0,0, max(cw, ns.cx), ns.cy);
-                used_h += ns.cy + (k>i?style.spacing:0);
-                line_w = max(line_w, ns.cx);
-            }
-            y += ch + style.spacing;
-            i = j-1;
-            continue;
-        }
-
-        Size ns = NaturalItemSize(it);
-        int needh = NaturalH(it);
-        if(wrap && y != vr.top && (y + needh > vr.bottom+1)) {
-            int free_px = (vr.bottom - vr.top) - (used_h ? (used_h - style.spacing) : 0);
-            CommitCol(col_start, i, max(0, free_px));
-            x += line_w + style.spacing;
-            y = vr.top;
-            col_start = i;
-            used_h = 0;
-            line_w = 0;
-        }
-        it.rect = RectC(0,0, ns.cx, needh);
-        used_h += needh + (i>col_start?style.spacing:0);
-        line_w = max(line_w, ns.cx);
-        y += needh + style.spacing;
-    }
-
-    if(col_start < items.GetCount()) {
-        int free_px = (GetView().GetHeight() - 2*style.padding) - (used_h ? (used_h - style.spacing) : 0);
-        CommitCol(col_start, items.GetCount(), max(0, free_px));
-    }
-
-    Rect cb(0,0,0,0); bool first=true;
-    for(const Item& it : items) {
-        if(it.kind==Kind::GridCell||it.kind==Kind::BlankGrid) continue;
-        if(first) { cb = it.rect; first=false; }
-        else cb |= it.rect;
+    if(virtual_mode) {
+        PaintVirtual(w);
+        return;
     }
-    if(first) cb = RectC(style.padding, style.padding, 0, 0);
-    cb.Inflate(style.padding);
-    content = cb.GetSize();
+    Rect q = w.GetPaintRect().Offseted(origin);
+    PaintClusters(w, q);
+    PaintClusterHeaders(w, q);
+    DebugPaint(w, q);
 }
 
-//==============================================================================
-// Height-for-width probe
-//==============================================================================
-
-/**
- * Compute natural total height for a given total width (including padding).
- * - Flow LTR: simulate wrapping using NaturalItemSize and spacing/padding.
- * - Flow TTB: width has little effect; returns content height for current data.
- * - Grid: independent of width; returns measured grid height for current items.
- * This method is a *probe*: it does not change child rects or scroll state.
- */
-int FlowGridLayout::MeasureHeightForWidth(int total_width) {
-    if(total_width <= 0)
-        return 0;
-
-    const int inner_w = max(0, total_width - 2*style.padding);
-
-    // Grid: height is just the grid measurement, independent of width
-    if(mode == FGLMode::Grid) {
-        // emulate the grid measurement part of Layout()
-        int maxrow = -1, maxcol = -1;
-        for(const Item& it : items)
-            if(it.kind == Kind::GridCell || it.kind == Kind::BlankGrid) {
-                maxrow = max(maxrow, it.row);
-                maxcol = max(maxcol, it.col);
-            }
-        const int rows = maxrow + 1;
-        Vector<int> rowh; rowh.SetCount(max(0, rows), 0);
-        for(const Item& it : items)
-            if(it.kind == Kind::GridCell) {
-                Size ns = NaturalItemSize(it);
-                rowh[it.row] = max(rowh[it.row], ns.cy);
-            }
-        int totalh = 0;
-        for(int rr = 0; rr < rowh.GetCount(); ++rr) totalh += rowh[rr] + (rr ? style.spacing : 0);
-        return totalh + 2*style.padding;
-    }
-
-    // Flow TopToBottom: width does not affect vertical packing much; approximate
-    if(dir == Direction::V) {
-        // Stack vertically until height sum (with spacing) – ignore column wraps
-        int hsum = 0, count = 0;
-        for(const Item& it : items) {
-            if(it.kind==Kind::GridCell || it.kind==Kind::BlankGrid || it.kind==Kind::Break) continue;
-            if(it.kind==Kind::Expander) continue; // expanders need container height
-            if(it.kind==Kind::Spacer || it.kind==Kind::Gap) { hsum += it.min_px; if(count) hsum += style.spacing; ++count; continue; }
-            Size ns = NaturalItemSize(it);
-            if(count) hsum += style.spacing;
-            hsum += ns.cy;
-            ++count;
-        }
-        return hsum + 2*style.padding;
-    }
-
-    // Flow LeftToRight: simulate rows
-    int x = 0, y = 0, line_h = 0;
-    auto NaturalW = [&](const Item& it)->int {
-        Size ns = NaturalItemSize(it);
-        if(it.kind==Kind::Spacer)   return it.min_px;
-        if(it.kind==Kind::Gap)      return it.min_px;
-        if(it.kind==Kind::Expander) return 0;
-        return ns.cx;
-    };
-
-    auto Newline = [&](){
-        y += line_h;
-        if(y > 0) y += style.spacing;
-        x = 0;
-        line_h = 0;
-    };
-
-    for(int i=0;i<items.GetCount();++i) {
-        const Item& it = items[i];
-        if(it.kind==Kind::GridCell || it.kind==Kind::BlankGrid) continue;
-
-        if(it.kind == Kind::Break) {
-            if(x > 0 || line_h > 0) Newline();
-            continue;
-        }
-
-        // Atomic cluster
-        if(it.cluster >= 0 && !clusters[it.cluster].flow) {
-            int j=i, cw=0, ch=0; bool first=false;
-            while(j<items.GetCount() && items[j].cluster==it.cluster &&
-                 !(items[j].kind==Kind::GridCell||items[j].kind==Kind::BlankGrid||items[j].kind==Kind::Break)) {
-                if(first) cw += style.spacing;
-                first = true;
-                cw += NaturalW(items[j]);
-                ch = max(ch, NaturalItemSize(items[j]).cy);
-                j++;
-            }
-            if(wrap && x>0 && x + cw > inner_w) Newline();
-            x += cw;
-            line_h = max(line_h, ch);
-            i = j-1;
-            if(x < inner_w) x += style.spacing;
-            continue;
-        }
-
-        const int wneed = NaturalW(it);
-        const int hneed = (it.kind==Kind::Spacer || it.kind==Kind::Gap) ? 0 : NaturalItemSize(it).cy;
-
-        if(wrap && x>0 && x + wneed > inner_w) Newline();
-        x += wneed;
-        line_h = max(line_h, hneed);
-        if(x < inner_w) x += style.spacing;
-    }
-    if(line_h > 0) y += line_h;
-    return y + 2*style.padding;
-}
 // FlowGridLayout.cpp — Debug overlay now uses predicates (no behavior change)
 
-void FlowGridLayout::DebugPaint(Upp::Draw& w) {
+void FlowGridLayout::DebugPaint(Upp::Draw& w, const Upp::Rect& q) {
     if(!debug) return;
 
     // View and inner content rect
@@ -1032,10 +1303,13 @@ void FlowGridLayout::DebugPaint(Upp::Draw& w) {
     w.DrawRect(inner.left, inner.top,     1,                  inner.GetHeight(), SColorShadow());
     w.DrawRect(inner.right-1, inner.top,  1,                  inner.GetHeight(), SColorShadow());
 
-    // Item cell rects (skip Grid-like cells and Break markers)
-    for(const Item& it : items) {
-        if(IsGridLike(it) || IsBreak(it)) continue;
-        Rect r = it.rect; r.Offset(-origin);
+    // Item cell rects under the paint rect (the engine skips Grid-like cells and Break markers)
+    if(mode == FGLMode::Grid || virtual_mode)
+        return;
+    Vector<int> cells;
+    engine.ItemsIn(q, cells);
+    for(int i : cells) {
+        Rect r = engine.GetItemRect(i).Offseted(-origin);
         Color c = SColorHighlight();
         w.DrawRect(r.left, r.top, r.GetWidth(), 1, c);
         w.DrawRect(r.left, r.bottom-1, r.GetWidth(), 1, c);
@@ -1054,9 +1328,40 @@ String FlowGridLayout::ToString() const {
       << ", padding=" << style.padding
       << ", unified=" << (unified ? AsString(unified_sz) : String("off"))
       << ", items=" << items.GetCount()
+      << ", virtual=" << (!virtual_mode ? String("off")
+                          : virtual_grid ? Format("%dx%d", engine.vrows, engine.vcols)
+                          : AsString(engine.vcount))
       << ", clusters=" << clusters.GetCount()
       << ", content=(" << content.cx << "x" << content.cy << ")"
-      << ", debug=" << (debug ? "on" : "off")
+      << ", debug=" << (debug ? "on" : "off");
+    if(stats_on)
+        s << ", stats=" << GetStats().ToString();
+    s << "}";
+    return s;
+}
+
+//==============================================================================
+// Instrumentation
+//==============================================================================
+
+FlowGridLayout::Stats FlowGridLayout::GetStats() const {
+    Stats s = stats;
+    s.probe_hits   = engine.counters.probe_hits;
+    s.probe_misses = engine.counters.probe_misses;
+    return s;
+}
+
+String FlowGridLayout::Stats::ToString() const {
+    String s;
+    s << "{layouts=" << layouts
+      << ", measured=" << measured
+      << ", child_min_size=" << child_min_size
+      << ", set_rect=" << set_rect
+      << ", probe=" << probe_hits << "/" << probe_hits + probe_misses
+      << ", measure=" << measure_us << "us"
+      << ", break=" << break_us << "us"
+      << ", place=" << place_us << "us"
+      << ", paint=" << paint_us << "us"
       << "}";
     return s;
 }
@@ -4,6 +4,8 @@
 #include <CtrlLib/CtrlLib.h>
 #include <limits.h>
 
+#include <FlowGridEngine/FlowGridEngine.h>
+
 namespace Upp {
 
 //==============================================================================
@@ -13,6 +15,8 @@ namespace Upp {
 // - Cluster features: keep items together, optional rounded boxes, headers.
 // - API parity: Inset/Gap, AlignItems, SetFixedColumn/Row via unified sizing.
 // - Sizing helpers: GetContentSize(), MeasureHeightForWidth(int).
+// - Virtual mode: count + size callback; only visible tiles are realized.
+// - Geometry lives in FlowGridEngine; this class measures, applies and paints.
 //==============================================================================
 
 
@@ -66,6 +70,8 @@ public:
 
     /** Create the layout; installs ScrollBars as a frame. */
     FlowGridLayout();
+    /** Waits for an in-flight asynchronous layout pass. */
+    ~FlowGridLayout();
 
     /** Set Flow vs Grid mode. Triggers relayout. */
     FlowGridLayout& SetMode(FGLMode m)                 { mode = m; Reflow(); return *this; }
@@ -75,11 +81,17 @@ public:
     FlowGridLayout& SetWrap(bool on = true)            { wrap = on; Reflow(); return *this; }
     /** Configure automatic vs fixed scroll policy. Updates scrollbars. */
     FlowGridLayout& SetScrollMode(FGLScroll m)         { scroll = m; UpdateScrollbars(); return *this; }
+    /** Glide wheel scrolling over several frames instead of jumping (one origin change per frame). */
+    FlowGridLayout& SetSmoothScroll(bool on = true)    { smooth_scroll = on; return *this; }
+    /** Keep the first visible item at the same view position when a relayout
+        moves it (items above it resized, inserted or removed). Not used at the
+        top of the content or in virtual mode. */
+    FlowGridLayout& SetScrollAnchoring(bool on = true) { scroll_anchoring = on; UpdateAnchor(); return *this; }
     /** Force a unified (fixed) cell size for all items. Triggers relayout. */
     FlowGridLayout& SetUnifiedItemSize(Size sz, bool on = true) { unified = on; unified_sz = sz; Reflow(); return *this; }
 
     /** Assign visual style (padding/spacing, headers, cluster boxes). */
-    FlowGridLayout& SetStyle(const Style& s)           { style = s; Refresh(); return *this; }
+    FlowGridLayout& SetStyle(const Style& s)           { style = s; ++measure_gen; box_patch.img.Clear(); Reflow(); return *this; }
     /** Read current style. */
     const Style&    GetStyle() const                   { return style; }
 
@@ -122,6 +134,30 @@ public:
         PauseScope(FlowGridLayout& l, bool r=true) : L(l), relayout(r) { L.PauseLayout(); }
         ~PauseScope() { L.ResumeLayout(relayout); }
     };
+    /** Setters and Add* only mark the layout dirty; one pass runs per event-loop
+        turn. Run it now if it is still pending, for callers that need the
+        geometry synchronously (never from Paint: the pass moves children).
+        In async mode the pass runs on this thread and supersedes a worker pass
+        in flight, which is waited for and dropped. */
+    FlowGridLayout& FlushLayout();
+
+    //-------------------------------------------------------------------------
+    // Asynchronous layout (large item counts)
+    //-------------------------------------------------------------------------
+
+    /**
+     * Compute layouts on a worker thread. Layout() measures on the GUI thread,
+     * hands a snapshot of the model to CoWork and returns; the finished engine
+     * is swapped in on the GUI thread. Until then the control keeps painting and
+     * answering queries from the last completed layout (clipped to the view).
+     * Results made stale by a model change (Add*, Set*, Invalidate*) are dropped;
+     * view-only changes arriving mid-pass are coalesced into one follow-up pass.
+     */
+    FlowGridLayout& SetAsyncLayout(bool on = true);
+    /** True when asynchronous layout is on. */
+    bool            IsAsyncLayout() const              { return async_layout; }
+    /** True while a worker pass is in flight. */
+    bool            IsLayoutPending() const            { return async_busy; }
 
     //-------------------------------------------------------------------------
     // Clusters
@@ -150,7 +186,8 @@ public:
      * @param cluster_id Cluster id (-1 = none).
      * @param scale_to_cell If true, control fills its assigned cell.
      * @param fixed If non-zero, overrides min-size unless unified sizing is on.
-     * @return Item index.
+     * @return Item handle (equal to the index until items are inserted, moved
+     *         or removed).
      */
     int Add(Ctrl& c, int cluster_id = -1, bool scale_to_cell = false, Size fixed = Size(0,0));
 
@@ -159,6 +196,22 @@ public:
         return Add(c, cluster_id, scale_to_cell, fixed);
     }
 
+    /** One control of a bulk AddRange() (same meaning as the Add() arguments). */
+    struct ItemSpec {
+        Ctrl *ctrl = nullptr;
+        int   cluster_id = -1;
+        bool  scale_to_cell = false;
+        Size  fixed = Size(0,0);
+    };
+
+    /**
+     * Add many controls at once: storage is reserved up front, the children are
+     * attached in one pass and the layout is invalidated once.
+     * @return Handle of the first item; the others follow consecutively.
+     */
+    int AddRange(const ItemSpec *spec, int count);
+    int AddRange(const Vector<ItemSpec>& spec)         { return AddRange(spec.begin(), spec.GetCount()); }
+
     /** Add a spacer with min/max pixels on the main axis. */
     int AddSpacer(int min_px = 0, int max_px = INT_MAX, int cluster_id = -1);
     /** Add an expanding gap (weight shares leftover on the main axis). */
@@ -177,6 +230,95 @@ public:
     /** Reserve a blank grid cell (affects row/col measurement). */
     int AddBlankGrid(int row, int col);
 
+    //-------------------------------------------------------------------------
+    // Editing (handles returned by Add* stay valid across these)
+    //-------------------------------------------------------------------------
+
+    /** Insert a control before the item `before` (-1 appends); returns its handle. */
+    int  Insert(int before, Ctrl& c, int cluster_id = -1, bool scale_to_cell = false, Size fixed = Size(0,0));
+    /** Remove an item and detach its control. Removals are swept in one pass before
+        the next layout. */
+    FlowGridLayout& Remove(int handle);
+    using Ctrl::Remove;             // detach from the parent
+    /** Move an item before the item `before` (-1 moves it to the end). */
+    FlowGridLayout& Move(int handle, int before);
+    /** Remove every item and detach all controls; clusters are kept, and handles
+        issued before are never reused. */
+    FlowGridLayout& Clear();
+    /** Current index of an item handle, or -1 if it was removed. */
+    int  GetIndex(int handle) const;
+    /** Number of items. */
+    int  GetCount() const                              { return items.GetCount() - removed_count; }
+
+    /** Grid tracks from the last layout (content coordinates). Offset `i` is the
+        leading edge of track i; GetColumnOffset(GetColumnCount()) is the far edge. */
+    int  GetColumnCount() const                        { return engine.GetGrid().col.count; }
+    int  GetRowCount() const                           { return engine.GetGrid().row.count; }
+    int  GetColumnOffset(int i) const;
+    int  GetRowOffset(int i) const;
+    /** Column/row containing a content coordinate, or -1 (outside or in a gap). O(log n). */
+    int  FindColumn(int x) const                       { return engine.FindColumn(x); }
+    int  FindRow(int y) const                          { return engine.FindRow(y); }
+
+    //-------------------------------------------------------------------------
+    // Measurement cache
+    //-------------------------------------------------------------------------
+
+    /** Child natural sizes (GetMinSize) are measured once and cached on the item.
+        Call this when a child's content changes its min size. Triggers relayout. */
+    FlowGridLayout& InvalidateItemSize(int handle);
+    /** Drop every cached natural size. Triggers relayout. Done automatically
+        on SetStyle() and when DPI scaling or the standard font changes. */
+    FlowGridLayout& InvalidateSizes()                  { ++measure_gen; Reflow(); return *this; }
+
+    //-------------------------------------------------------------------------
+    // Virtual mode (callback-driven tiles; no Ctrl per item)
+    //-------------------------------------------------------------------------
+
+    /**
+     * Switch to virtual mode: `count` tiles flowed like CtrlItems.
+     * @param count   Number of tiles.
+     * @param size_fn Natural tile size by index (unified sizing wins if on).
+     * Real items are ignored while virtual mode is on; Grid mode is not used.
+     */
+    FlowGridLayout& SetVirtual(int count, Function<Size(int)> size_fn);
+    /** Change the tile count (e.g. after the data source grew). Triggers relayout. */
+    FlowGridLayout& SetVirtualCount(int count);
+    /** Leave virtual mode; unrealizes all tiles. Triggers relayout. */
+    FlowGridLayout& NoVirtual();
+    /**
+     * Switch to a virtual grid of rows x cols cells; tile index = row * cols + col.
+     * Only cells intersecting the view are painted or realized, in both
+     * directions. Track offsets live in Fenwick trees, so scrolling to any row
+     * and correcting an estimated track size are O(log n).
+     * @param row_height Height of a row (fixed or estimated).
+     * @param col_width  Width of a column (fixed or estimated).
+     */
+    FlowGridLayout& SetVirtualGrid(int rows, int cols, Function<int(int)> row_height, Function<int(int)> col_width);
+    /** Change the grid size; known track sizes are kept, only new tracks are queried. */
+    FlowGridLayout& SetVirtualGridSize(int rows, int cols);
+    /** Replace an estimated row height / column width once the real one is known. */
+    FlowGridLayout& SetVirtualRowHeight(int row, int cy);
+    FlowGridLayout& SetVirtualColumnWidth(int col, int cx);
+    /** True when virtual mode is on. */
+    bool            IsVirtual() const                  { return virtual_mode; }
+    /** True when virtual mode lays out a grid (SetVirtualGrid). */
+    bool            IsVirtualGrid() const              { return virtual_mode && virtual_grid; }
+    /** Number of virtual tiles. */
+    int             GetVirtualCount() const            { return engine.vcount; }
+
+    /** Tile index under a view point, or -1. */
+    int  VirtualItemAt(Point p) const;
+    /** Tile cell in content coordinates (empty if out of range). */
+    Rect GetVirtualItemRect(int index) const;
+
+    /** Paint a visible, non-realized tile into `r` (view coordinates). */
+    Function<void(Draw& w, const Rect& r, int index)> WhenPaintItem;
+    /** Optionally supply a live Ctrl for a visible tile (caller owns/pools it). */
+    Function<Ctrl*(int index)>                         WhenRealize;
+    /** A realized tile left the view; its Ctrl has already been detached. */
+    Function<void(int index, Ctrl& c)>                 WhenUnrealize;
+
     //-------------------------------------------------------------------------
     // Headers and selection
     //-------------------------------------------------------------------------
@@ -184,11 +326,15 @@ public:
     /** Enable group headers globally (per-cluster can override). */
     FlowGridLayout& SetGroupHeaders(bool on = true)    { default_cluster_header = on; Refresh(); return *this; }
     /** Provide header text callback (cluster id -> text). */
-    FlowGridLayout& WhenClusterText(Upp::Function<Upp::String(int)> fn) { when_group_text = pick(fn); Refresh(); return *this; }
+    FlowGridLayout& WhenClusterText(Upp::Function<Upp::String(int)> fn) { when_group_text = pick(fn); InvalidateAllClusterText(); return *this; }
     /** Alias for WhenClusterText. */
-    FlowGridLayout& WhenGroupText(Upp::Function<Upp::String(int)> fn)   { when_group_text = pick(fn); Refresh(); return *this; }
+    FlowGridLayout& WhenGroupText(Upp::Function<Upp::String(int)> fn)   { return WhenClusterText(pick(fn)); }
+    /** Header texts are queried once and cached; re-query one cluster's text on next paint. */
+    FlowGridLayout& InvalidateClusterText(int id);
+    /** Re-query every header text (e.g. after a language change). */
+    FlowGridLayout& InvalidateAllClusterText()         { ++cluster_text_gen; Refresh(); return *this; }
 
-    /** Return current selection (virtual mode stub). */
+    /** Return current selection (item or tile indices). */
     const Upp::Vector<int>& GetSelection() const       { return selection; }
     /** Clear selection and repaint. */
     void ClearSelection()                              { selection.Clear(); Refresh(); }
@@ -203,6 +349,10 @@ public:
     /** Paint background, clusters, headers, and optional debug overlay. */
     void Paint(Upp::Draw& w) override;
 
+    /** Wheel deltas accumulate and are applied once per frame. */
+    void MouseWheel(Point p, int zdelta, dword keyflags) override;
+    void HorzMouseWheel(Point p, int zdelta, dword keyflags) override;
+
 
 	/** Conservative natural size.
 	    - Flow LTR + wrap: reports height-for-width using a conservative width.
@@ -218,45 +368,93 @@ public:
     /** Optional height-for-width probe (includes padding). */
     int MeasureHeightForWidth(int total_width);
 
+    /** The Ctrl-free layout engine (read-only; valid after Layout). */
+    const FlowGridEngine& GetEngine() const { return engine; }
+
+    //-------------------------------------------------------------------------
+    // Geometry queries (indices built by Layout; view coordinates in/out)
+    //-------------------------------------------------------------------------
+
+    /** Item (or virtual tile) under a view point, or -1. O(log n). */
+    int         ItemAt(Point p) const;
+    /** Items (or virtual tiles) whose cells intersect a view rect, in layout order. */
+    Vector<int> ItemsIn(const Rect& r) const;
+    /** Cluster whose bounds contain a view point, or -1. */
+    int         ClusterAt(Point p) const;
+    /** Cell rect of an item in view coordinates (empty if out of range). */
+    Rect        GetItemRect(int handle) const;
+
     /** Notifies on content size changes. */
     Upp::Function<void(Upp::Size)> WhenContentSize;
     Upp::String ToString() const;
 
+    //-------------------------------------------------------------------------
+    // Instrumentation
+    //-------------------------------------------------------------------------
+
+    /** Counters since the last ResetStats(); phase times (usecs) need EnableStats(). */
+    struct Stats {
+        int64 layouts = 0;          ///< Layout passes applied (sync or adopted async).
+        int64 measured = 0;         ///< Items measured into the engine.
+        int64 child_min_size = 0;   ///< GetMinSize() calls made on children.
+        int64 set_rect = 0;         ///< SetRect() calls issued to children.
+        int64 probe_hits = 0;       ///< Height-for-width probes served from the cache.
+        int64 probe_misses = 0;     ///< Probes that scanned the items.
+        int64 measure_us = 0;       ///< Measure phase.
+        int64 break_us = 0;         ///< Engine pass (line breaking and placement math).
+        int64 place_us = 0;         ///< Applying child rects, cluster index, scrollbars.
+        int64 paint_us = 0;         ///< Paint().
+
+        String ToString() const;
+    };
+
+    /** Collect phase timings. Counters are plain increments and always kept;
+        timing adds two clock reads per phase, so it is off by default. */
+    FlowGridLayout& EnableStats(bool on = true)        { stats_on = on; return *this; }
+    bool            IsStatsEnabled() const             { return stats_on; }
+    /** Snapshot of the counters since the last reset. */
+    Stats           GetStats() const;
+    void            ResetStats()                       { stats = Stats(); engine.counters = FlowGridEngine::Counters(); }
+
 
 private:
     //----- Internal model -----------------------------------------------------
+    // Geometry (kinds, natural sizes, cells, lines, tracks, cluster bounds) is
+    // held by `engine`; the vectors below run parallel to its items/clusters.
 
-    enum class Kind : byte { CtrlItem, Spacer, Expander, Gap, GridCell, BlankGrid, Break };
+    using Kind = FlowGridEngine::Kind;
+    using Line = FlowGridEngine::Line;
 
     struct Item : Moveable<Item> {
-        Kind  kind = Kind::CtrlItem;
-        int   cluster = -1;         // cluster id (keep-together unit)
         Ctrl* ctrl = nullptr;
-        bool  scale_to_cell = false;
         Size  fixed = Size(0,0);    // overrides min size unless unified is on
-        int   min_px = 0;           // spacer/gap min
-        int   max_px = INT_MAX;     // spacer max
-        int   weight = 0;           // expander weight
-        int   row = -1, col = -1;   // grid addressing
-        Rect  rect;                 // computed cell area
-        bool  visible = true;
+        int   measured = -1;        // measure generation of the engine's size slot
+        int   handle = -1;          // stable id; -1 once removed (swept before the next pass)
+    };
+
+    // Rect index for culling: entries sorted by leading edge on the band axis,
+    // with a running max of the trailing edge, so a band query is two binary
+    // searches plus the entries that actually straddle the band.
+    struct RectIndex {
+        Vector<int>  id;
+        Vector<Rect> rc;
+        Vector<int>  reach;         // running max of trailing edge
+        bool         horz = false;  // band axis: false = y, true = x
+
+        void Clear()                { id.Clear(); rc.Clear(); reach.Clear(); }
+        void Add(int i, const Rect& r) { id.Add(i); rc.Add(r); }
+        void Finish(bool horz);
+        template <class F> void Query(const Rect& q, F fn) const;
     };
 
     struct Cluster : Moveable<Cluster> {
         bool box  = false;      // draw rounded box (style-driven)
-        bool flow = false;      // allow wrapping inside cluster
         int8 header = -1;       // -1 inherit, 0 off, 1 on
-        Rect bounds;            // union of child cell rects
+        String text;            // cached header text (see ClusterText)
+        Size   text_sz;         // its extent in StdFont()
+        int    text_gen = -1;   // cluster_text_gen it was fetched under
     };
 
-    static inline bool IsBreak   (const Item& it) { return it.kind == Kind::Break; }
-    static inline bool IsSpacer  (const Item& it) { return it.kind == Kind::Spacer; }
-    static inline bool IsGap     (const Item& it) { return it.kind == Kind::Gap; }
-    static inline bool IsExpander(const Item& it) { return it.kind == Kind::Expander; }
-    static inline bool IsCtrl    (const Item& it) { return it.kind == Kind::CtrlItem || it.kind == Kind::GridCell; }
-    static inline bool IsGridLike(const Item& it) { return it.kind == Kind::GridCell || it.kind == Kind::BlankGrid; }
-    static inline bool IsFlowRenderable(const Item& it) { return !(IsGridLike(it) || IsBreak(it)); }
-    
     // Config/state
     FGLMode  mode   = FGLMode::Flow;
     Direction   dir    = Direction::H;
@@ -268,22 +466,76 @@ private:
     Align    align_items = Stretch;
     bool     debug = false;
 
+    // Instrumentation (see GetStats)
+    bool          stats_on = false;
+    mutable Stats stats;            // probe counters live in engine.counters
+
     // Throttling / reentrancy guards
     bool laying_out = false;
     bool updating_sb = false;
     int  layout_pause = 0;
     bool pending_layout = false;
+    bool layout_scheduled = false;  // TIMEID_REFLOW pending (see ScheduleLayout)
+
+    // Asynchronous layout
+    enum { TIMEID_ASYNC = Ctrl::TIMEID_COUNT, TIMEID_SCROLL, TIMEID_REFLOW, TIMEID_COUNT };
+    bool                async_layout = false;
+    bool                async_busy = false;     // a worker pass is in flight
+    bool                async_again = false;    // relayout requested while busy
+    int                 layout_gen = 0;         // bumped by every Reflow
+    CoWork              async_work;
+    Mutex               async_lock;             // guards async_done*
+    One<FlowGridEngine> async_done;             // finished worker result
+    int                 async_done_gen = -1;    // layout_gen it was computed for
+    int64               async_done_us = 0;      // its engine time (when stats are on)
+
+    // Measurement cache (see MeasureItems)
+    mutable int measure_gen  = 0;
+    mutable int measure_skin = 0;   // DPI/font token the cache was filled under
+
+    // What the last Layout assumed (the engine tracks dirty items itself)
+    Point last_origin;
+    int   last_measure_gen = -1;
 
     // Content reporting
     Upp::Size last_reported_content{0, 0};
 
-    Vector<Item>    items;
-    Vector<Cluster> clusters;
+    FlowGridEngine  engine;
+    Vector<Item>    items;          // parallel to the engine's items
+    Vector<Cluster> clusters;       // parallel to engine.clusters
     int             cur_cluster = -1;
 
+    // Stable handles: ids are issued in Add order, so they equal indices until
+    // the first Insert/Move/Remove; handle_pos maps them back and is kept
+    // current by every edit.
+    int                 next_handle = 0;
+    int                 removed_count = 0;  // tombstones awaiting SweepRemoved()
+    Vector<int>         handle_pos;         // handle -> index, -1 when removed
+
+    Vector<int>     moved;          // placement scratch: items to move
+    Vector<int>     placed;         // uniform tiles: children in the view (all others parked)
+    bool            parked = false; // children outside `placed` have empty rects
+
+    // Paint index (rebuilt by Layout)
+    RectIndex       cluster_index;  // decorated cluster rects (box + header band)
+
+    // Cluster box corners, rendered once per radius/colors (see ClusterBoxPatch)
+    struct BoxPatch {
+        Image img;
+        int   radius = -1;
+        Color border, bg;
+    };
+    mutable BoxPatch box_patch;
+
+    // Virtual mode (tile count and sizes live in the engine)
+    bool                  virtual_mode = false;
+    bool                  virtual_grid = false;   // rows x cols (engine.vrows/vcols)
+    VectorMap<int, Ctrl*> vrealized;    // tile index -> live Ctrl
+
     // Headers
     bool default_cluster_header = false;
     Function<String(int)> when_group_text;
+    mutable int           cluster_text_gen = 0; // bumping it drops every cached header text
 
     // Selection
     Vector<int> selection;
@@ -291,28 +543,68 @@ private:
     // Scrollbars and geometry
     ScrollBars sb;
     Point      origin = Point(0,0);
+    Point      scroll_target = Point(0,0);  // origin the pending scroll frame moves toward
+    bool       scroll_pending = false;      // a scroll frame is scheduled
+    bool       scroll_glide = false;        // current target is approached smoothly
+    bool       smooth_scroll = false;
     Size       content = Size(0,0);
 
+    // Scroll anchoring: item handle and its view position after the last layout/scroll
+    bool       scroll_anchoring = false;
+    int        anchor_handle = -1;
+    Point      anchor_pos = Point(0,0);
+
     Style style = Style::StyleDefault();
 
     // Helpers
-    void Reflow()                  { if(layout_pause == 0) RefreshLayout(); else pending_layout = true; }
+    void Reflow(int lo = 0, int hi = INT_MAX) {
+        engine.Invalidate(lo, hi);
+        ++layout_gen;
+        if(layout_pause == 0) ScheduleLayout(); else pending_layout = true;
+    }
+    void ScheduleLayout();
     void UpdateScrollbars();
-    void ApplyScrollbars();
-
-    // Flow passes
-    void LayoutHorizontal();
-    void LayoutVertical();
+    Size ScrollLimit() const;
+    void ScrollTo(Point p);
+    bool ScrollBy(Point d);
+    void RequestScrollFrame();
+    void ScrollFrame();
+    void ScrollChildren(Point old_origin);
+    void UpdateAnchor();
+    void ApplyAnchor();
+    FlowGridEngine::Options GetOptions() const;
+    void MeasurePending();
+    void FinishLayout(bool all);
+    void ApplyPlacement(int lo, int hi);
+    void PlaceVisible();
+    void StartAsyncLayout();
+    void AdoptAsyncLayout();
+    void DropAsyncLayout();
+    void LayoutSync(bool all);
+    int  AddItem(Kind kind, int cluster_id, FlowGridEngine::Item it);
+    void SweepRemoved();
+    void RenumberHandles(int lo, int hi);
+
+    // Virtual mode
+    void SyncVirtual();
+    void UnrealizeAll();
+    void PaintVirtual(Upp::Draw& w);
 
     // Measurement helpers
-    Size NaturalItemSize(const Item& it) const;
+    Size MeasureItem(int i);
+    void MeasureItems(int from = 0);
+    void SyncMeasureSkin() const;
     int  EnsureCluster(int cluster);
 
-    // Painting helpers
-    void PaintClusters(Upp::Draw& w);
+    // Painting helpers (q: paint rect in content coordinates)
+    void BuildClusterIndex();
+    const Image& ClusterBoxPatch();
+    void PaintClusterBox(Upp::Draw& w, const Upp::Rect& r);
+    void PaintClusters(Upp::Draw& w, const Upp::Rect& q);
+    const Cluster& ClusterText(int id);
     void PaintGroupHeader(Upp::Draw& w, const Upp::Rect& r, int cluster_id);
-    void PaintClusterHeaders(Upp::Draw& w);
-    void DebugPaint(Upp::Draw& w);
+    void PaintClusterHeaders(Upp::Draw& w, const Upp::Rect& q);
+    void DebugPaint(Upp::Draw& w, const Upp::Rect& q);
 };
 
 } // namespace Upp
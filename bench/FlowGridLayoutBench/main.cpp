@@ -0,0 +1,309 @@
+#include <Core/Core.h>
+#include <FlowGridEngine/FlowGridEngine.h>
+
+#include <atomic>
+
+using namespace Upp;
+
+//==============================================================================
+// FlowGridLayoutBench: headless throughput of the layout engine.
+// - Workloads: Flow H/V with wrap, atomic clusters, spacers/expanders/breaks,
+//   dense and sparse grids, virtual tiles, a virtual grid and unified thumbnails,
+//   at 100 / 10k / 200k items (cells).
+// - Ops: full layout, tail-append relayout, MeasureHeightForWidth (cold and
+//   cached), GetMinSize, bulk model build and the paint-side culling query (one
+//   viewport page per op).
+// - Output: one JSON object per line (stdout, and -o file); -b compares to a
+//   baseline file, the 10k -> 200k ns/item ratio checks the O(n) claim and the
+//   bulk build must allocate the same few blocks at every size.
+//
+// Usage: FlowGridLayoutBench [-o out.jsonl] [-b baseline.jsonl] [-t pct] [-n max_items]
+//==============================================================================
+
+// ---------- allocation counter ----------
+// Built with USEMALLOC (see the .upp), so every U++ and C++ allocation ends in
+// malloc; on Linux the linker wraps it (-Wl,--wrap) and we count the calls.
+static std::atomic<int64> s_allocs(0);
+
+#ifdef PLATFORM_LINUX
+extern "C" {
+void *__real_malloc(size_t sz);
+void *__real_calloc(size_t n, size_t sz);
+void *__real_realloc(void *p, size_t sz);
+void *__wrap_malloc(size_t sz)             { ++s_allocs; return __real_malloc(sz); }
+void *__wrap_calloc(size_t n, size_t sz)   { ++s_allocs; return __real_calloc(n, sz); }
+void *__wrap_realloc(void *p, size_t sz)   { ++s_allocs; return __real_realloc(p, sz); }
+}
+static bool HasAllocCount() { return true; }
+#else
+static bool HasAllocCount() { return false; }
+#endif
+
+// ---------- workloads ----------
+typedef FlowGridEngine::Kind Kind;
+
+// Deterministic xorshift, so runs and baselines see identical item sizes.
+struct Rng {
+    dword s;
+    Rng(dword seed) : s(seed) {}
+    int operator()(int n) { s ^= s << 13; s ^= s >> 17; s ^= s << 5; return int(s % (dword)n); }
+};
+
+static const char *s_workloads[] = { "flow_h", "flow_v", "clusters", "mixed", "sections", "grid", "grid_sparse", "virtual", "virtual_grid", "uniform" };
+
+static FlowGridEngine::Item CtrlItem(Rng& rnd, int cluster = -1) {
+    FlowGridEngine::Item it;
+    it.kind    = Kind::CtrlItem;
+    it.cluster = cluster;
+    it.size    = Size(24 + rnd(96), 20 + rnd(20));
+    return it;
+}
+
+/** Fill an engine with `n` items of the named workload and return its options. */
+static FlowGridEngine::Options Build(FlowGridEngine& e, const String& w, int n) {
+    FlowGridEngine::Options o;
+    o.spacing = 6;
+    o.padding = 8;
+    o.wrap    = true;
+    o.horz    = w != "flow_v";
+
+    Rng rnd(12345);
+    e.Reserve(n);
+    if(w == "flow_h" || w == "flow_v")
+        for(int i = 0; i < n; ++i)
+            e.Add(CtrlItem(rnd));
+    else
+    if(w == "clusters")
+        for(int i = 0; i < n; ++i) {
+            int id = e.EnsureCluster(i / 4); // atomic blocks of four
+            e.Add(CtrlItem(rnd, id));
+        }
+    else
+    if(w == "mixed")
+        for(int i = 0; i < n; ++i) {
+            FlowGridEngine::Item it;
+            if(i % 50 == 49)
+                it.kind = Kind::Break;
+            else
+            if(i % 7 == 3) {
+                it.kind   = Kind::Expander;
+                it.weight = 1 + rnd(3);
+            }
+            else
+            if(i % 5 == 1) {
+                it.kind   = Kind::Spacer;
+                it.min_px = 4;
+                it.max_px = 40;
+            }
+            else
+                it.size = Size(24 + rnd(96), 20 + rnd(20));
+            e.Add(it);
+        }
+    else
+    if(w == "sections") // dashboard: Break-separated sections, laid out in parallel
+        for(int i = 0; i < n; ++i) {
+            FlowGridEngine::Item it = CtrlItem(rnd);
+            if(i % 1000 == 999)
+                it.kind = Kind::Break;
+            e.Add(it);
+        }
+    else
+    if(w == "grid" || w == "grid_sparse") {
+        o.grid = true;
+        int cols   = max(1, (int)sqrt((double)n));
+        int stride = w == "grid" ? 1 : 100; // sparse: 99 empty tracks between occupied ones
+        for(int i = 0; i < n; ++i) {
+            FlowGridEngine::Item it = CtrlItem(rnd);
+            it.kind = Kind::GridCell;
+            it.row  = i / cols * stride;
+            it.col  = i % cols * stride;
+            e.Add(it);
+        }
+    }
+    else
+    if(w == "uniform") { // thumbnails: closed-form layout
+        o.unified    = true;
+        o.unified_sz = Size(96, 96);
+        for(int i = 0; i < n; ++i)
+            e.Add(CtrlItem(rnd));
+    }
+    else
+    if(w == "virtual") {
+        o.virt   = true;
+        e.vcount = n;
+        e.vsize  = [](int i) { return Size(40 + i % 7 * 8, 32 + i % 3 * 8); };
+    }
+    else
+    if(w == "virtual_grid") { // data view: n cells in 20 columns
+        o.virt      = true;
+        o.vgrid     = true;
+        e.vcols     = 20;
+        e.vrows     = n / e.vcols;
+        e.vcount    = e.vrows * e.vcols;
+        e.vrow_size = [](int i) { return 20 + i % 3 * 4; };
+        e.vcol_size = [](int i) { return 60 + i % 5 * 10; };
+    }
+    return o;
+}
+
+// ---------- measurement ----------
+struct Result : Moveable<Result> {
+    String workload, op;
+    int    items = 0;
+    int    reps = 0;
+    double ns_per_op = 0;
+    double ns_per_item = 0;
+    double allocs_per_op = -1;
+};
+
+/** Run `op` (after one warm-up) until ~250ms have passed, at least 3 times. */
+template <class F>
+static Result Measure(const String& w, int n, const char *name, F op) {
+    op();
+    Result r;
+    r.workload = w;
+    r.items    = n;
+    r.op       = name;
+    int64 a0 = s_allocs;
+    int64 t0 = usecs();
+    int64 t;
+    do {
+        op();
+        ++r.reps;
+        t = usecs() - t0;
+    }
+    while(r.reps < 3 || t < 250000);
+    r.ns_per_op   = 1000.0 * t / r.reps;
+    r.ns_per_item = r.ns_per_op / max(n, 1);
+    if(HasAllocCount())
+        r.allocs_per_op = double(s_allocs - a0) / r.reps;
+    return r;
+}
+
+static String AsJsonLine(const Result& r) {
+    return Json("workload", r.workload)("items", r.items)("op", r.op)("reps", r.reps)
+               ("ns_per_op", r.ns_per_op)("ns_per_item", r.ns_per_item)
+               ("allocs_per_op", r.allocs_per_op).ToString();
+}
+
+static String Key(const String& w, int n, const String& op) { return w + "/" + AsString(n) + "/" + op; }
+
+/** Benchmark every op of one workload size. */
+static void RunWorkload(const String& w, int n, Vector<Result>& out) {
+    const Rect view(0, 0, 1200, 800);
+    FlowGridEngine e;
+    FlowGridEngine::Options o = Build(e, w, n);
+
+    out.Add(Measure(w, n, "layout_full", [&] { e.Invalidate(); e.Layout(view, o); }));
+    if(!o.grid && !o.virt)
+        out.Add(Measure(w, n, "layout_append", [&] { e.Invalidate(n - 1, n - 1); e.Layout(view, o); }));
+    // Probes are cached per model generation; Invalidate() makes them cold.
+    out.Add(Measure(w, n, "measure_hfw", [&] { e.Invalidate(); e.MeasureHeightForWidth(view.GetWidth(), o); }));
+    int jitter = 0; // a parent resizing by a pixel stays inside the cached width interval
+    out.Add(Measure(w, n, "measure_hfw_warm", [&] { e.MeasureHeightForWidth(view.GetWidth() - (++jitter & 1), o); }));
+    out.Add(Measure(w, n, "min_size", [&] { e.Invalidate(); e.GetMinSize(view.GetWidth(), o); }));
+    if(!o.virt) { // the engine half of FlowGridLayout::AddRange(); no controls headless
+        Vector<FlowGridEngine::Item> spec;
+        spec.Reserve(n);
+        for(int i = 0; i < n; ++i)
+            spec.Add(e.Get(i));
+        out.Add(Measure(w, n, "add_range", [&] { FlowGridEngine f; f.Add(spec.begin(), n); }));
+    }
+
+    // Paint culls to one page per frame; scroll through the content page by page.
+    e.Layout(view, o);
+    Size content = e.GetContentSize();
+    Vector<int> visible;
+    int page = 0;
+    Result& r = out.Add(Measure(w, n, "paint_cull", [&] {
+        Point p = o.horz ? Point(0, page * view.GetHeight() % max(content.cy, 1))
+                         : Point(page * view.GetWidth() % max(content.cx, 1), 0);
+        ++page;
+        visible.Clear();
+        e.ItemsIn(view.Offseted(p), visible);
+    }));
+    r.ns_per_item = r.ns_per_op / max(visible.GetCount(), 1); // per painted item
+}
+
+CONSOLE_APP_MAIN
+{
+    const Vector<String>& cmd = CommandLine();
+    String out_path, baseline_path;
+    double tolerance = 25;
+    int    max_items = 200000;
+    for(int i = 0; i + 1 < cmd.GetCount(); i += 2) {
+        if(cmd[i] == "-o") out_path = cmd[i + 1];
+        if(cmd[i] == "-b") baseline_path = cmd[i + 1];
+        if(cmd[i] == "-t") tolerance = ScanDouble(cmd[i + 1]);
+        if(cmd[i] == "-n") max_items = ScanInt(cmd[i + 1]);
+    }
+
+    Vector<Result> results;
+    for(const char *w : s_workloads)
+        for(int n : { 100, 10000, 200000 })
+            if(n <= max_items) {
+                int from = results.GetCount();
+                RunWorkload(w, n, results);
+                for(int i = from; i < results.GetCount(); ++i)
+                    Cout() << AsJsonLine(results[i]) << "\n";
+            }
+
+    if(out_path.GetCount()) {
+        String s;
+        for(const Result& r : results)
+            s << AsJsonLine(r) << "\n";
+        if(!SaveFile(out_path, s))
+            Cerr() << "cannot write " << out_path << "\n";
+    }
+
+    bool failed = false;
+
+    // O(n) check: per-item cost must not grow much from 10k to 200k items.
+    VectorMap<String, double> by_key;
+    for(const Result& r : results)
+        by_key.Add(Key(r.workload, r.items, r.op), r.ns_per_item);
+    for(const Result& r : results)
+        if(r.items == 200000 && r.op != "paint_cull") {
+            double small = by_key.Get(Key(r.workload, 10000, r.op), 0);
+            if(small > 0 && r.ns_per_item > 2 * small) {
+                Cerr() << "NONLINEAR " << Key(r.workload, r.items, r.op) << ": "
+                       << r.ns_per_item << " ns/item vs " << small << " at 10k\n";
+                failed = true;
+            }
+        }
+
+    // Bulk add reserves once per array: the allocation count must not depend on n.
+    if(HasAllocCount()) {
+        VectorMap<String, double> allocs;
+        for(const Result& r : results)
+            if(r.op == "add_range")
+                allocs.Add(r.workload + "/" + AsString(r.items), r.allocs_per_op);
+        for(const Result& r : results)
+            if(r.op == "add_range" && r.items > 100) {
+                double small = allocs.Get(r.workload + "/100", r.allocs_per_op);
+                if(r.allocs_per_op > small) {
+                    Cerr() << "ALLOCS " << Key(r.workload, r.items, r.op) << ": "
+                           << r.allocs_per_op << " per op vs " << small << " at 100\n";
+                    failed = true;
+                }
+            }
+    }
+
+    // Baseline comparison (same machine and build mode expected).
+    if(baseline_path.GetCount()) {
+        for(const String& ln : Split(LoadFile(baseline_path), '\n')) {
+            Value v = ParseJSON(ln);
+            if(IsError(v) || IsNull(v))
+                continue;
+            String key = Key(v["workload"], v["items"], v["op"]);
+            int q = by_key.Find(key);
+            double base = v["ns_per_item"];
+            if(q >= 0 && base > 0 && by_key[q] > base * (1 + tolerance / 100)) {
+                Cerr() << "REGRESSION " << key << ": " << by_key[q] << " ns/item vs baseline " << base << "\n";
+                failed = true;
+            }
+        }
+    }
+
+    SetExitCode(failed ? 1 : 0);
+}